@@ -0,0 +1,728 @@
+// PSP-KillSwitch handler microbenchmark
+// User mode EBOOT that links the handlers of one plugin and times them with synthetic inputs and event streams.
+//
+// Build with -DKILLSWITCH_BUILD_BENCH=ON, then run the bench for each plugin variant under PPSSPP or on hardware.
+// Results are printed to the screen and to stdout as min/median/max CPU cycles per call, and every sample is written
+// to <module>Bench.json in the current directory for tools/ks_benchcompare.py.
+// The COP0 count register isn't readable from user mode, so time is taken from sceKernelGetSystemTimeLow()
+// over large batches and converted to cycles using the current CPU clock.
+//
+// Every scenario runs twice, with warm caches and then with both caches evicted before each call, by dirtying a buffer
+// and running a block of code each twice the size of the cache. The cold numbers are what a suspend query really
+// costs, since the game has had the caches to itself for a while when one comes in. Build a second bench with
+// -DKILLSWITCH_HOT_COLD_LAYOUT=OFF and compare the cold results to see what the layout in ks_layout.h is worth.
+//
+// The stream scenarios replay a sequence of power callbacks, sysevents and pad states, one event per call: a built in
+// synthetic session, and a recorded one if <module>.stream is in the current directory (see tools/ks_trace2stream.py).
+// Before timing anything, a seeded random stream and the recorded one are replayed once on a virtual clock and every
+// decision is written to <module>Bench.decisions, so two builds can be checked for identical behaviour with
+// tools/ks_benchdiff.py.
+//
+// Built with -DKILLSWITCH_FAULTS=ON it also checks the decisions hold up with faults injected into the SDK calls
+// (ks_fault.h), and times a power switch decision with a stalled pad read.
+//
+// Built with -DKILLSWITCH_POLICY=ON it loads the policy program installed for the plugin, so the switch decisions
+// are timed and logged with it. Without one it's the same as the normal build.
+//
+// Ryan Crosby 2025
+
+#include <pspctrl.h>
+#include <pspkernel.h>
+#include <psputils.h>
+
+// Replayed streams supply the pad state, the other scenarios read the real pad as before.
+// The fault build wraps the pad read itself, so there the replayed read goes behind its fault check.
+static int bench_ctrl_peek(SceCtrlData *pad_data, int count);
+#if defined(KILLSWITCH_FAULTS)
+#define KS_FAULT_CTRL_PEEK_FN bench_ctrl_peek
+#else
+#define sceCtrlPeekBufferPositive bench_ctrl_peek
+#endif
+
+// The decision log runs the plugin on a virtual clock, so its timed rules don't depend on how fast the bench runs
+static unsigned int bench_time_low(void);
+static clock_t bench_libc_clock(void);
+#define sceKernelGetSystemTimeLow bench_time_low
+#define sceKernelLibcClock bench_libc_clock
+
+// Pull in the plugin's handlers. BENCH_PLUGIN_SOURCE is set by bench/CMakeLists.txt.
+// KILLSWITCH_BENCH strips the module info and all of the kernel mode registration code.
+#include BENCH_PLUGIN_SOURCE
+
+#undef sceCtrlPeekBufferPositive
+#undef sceKernelGetSystemTimeLow
+#undef sceKernelLibcClock
+
+#include <pspdebug.h>
+#include <pspdisplay.h>
+
+#include <stdio.h>
+#include <string.h>
+
+PSP_MODULE_INFO(MODULE_NAME "Bench", PSP_MODULE_USER, MAJOR_VER, MINOR_VER);
+PSP_MAIN_THREAD_ATTR(PSP_THREAD_ATTR_USER);
+
+// Each scenario is timed in BENCH_SAMPLES batches of BENCH_BATCH calls, ~2M calls per scenario.
+#define BENCH_SAMPLES 64
+#define BENCH_BATCH 32768
+// Evicting the caches costs far more than the handlers, so cold batches are smaller
+#define BENCH_COLD_BATCH 1024
+
+// Allegrex has 16KB I and D caches. Twice that pushes out every line whatever the replacement order.
+#define BENCH_EVICT_SIZE (32 * 1024)
+
+#define BENCH_PRINT(...) do { pspDebugScreenPrintf(__VA_ARGS__); printf(__VA_ARGS__); } while(0)
+
+typedef void (*bench_fn)(unsigned int i);
+
+typedef struct {
+    const char *name;
+    bench_fn fn;
+    bool stream;    // Replays a stream, and the pad state with it
+} bench_scenario;
+
+// Event streams, replayed one event per call
+#define BENCH_EVENT_PAD         0 // value = buttons, or the pad read error
+#define BENCH_EVENT_CALLBACK    1 // value = pwrflags
+#define BENCH_EVENT_SYSEVENT    2 // value = event id
+
+#define BENCH_STREAM_MAX 4096
+// Time between the events of a recorded stream that doesn't give it
+#define BENCH_EVENT_STEP_US 1000
+// Virtual time after a reset, long enough that the plugin's "never" timestamps of 0 are well in the past
+#define BENCH_CLOCK_START_US (60 * 1000 * 1000)
+#define BENCH_STREAM_PATH MODULE_NAME ".stream"
+#define BENCH_JSON_PATH MODULE_NAME "Bench.json"
+
+// On battery at 80%, so the low battery bypass stays out of the way
+#define BENCH_BATTERY (PSP_POWER_CB_BATTERY_EXIST | 80)
+
+typedef struct {
+    unsigned int kind;
+    unsigned int value;
+    unsigned int delay_us;  // Virtual time since the previous event
+} bench_event;
+
+static int sink;
+static bool cold_cache = false;
+
+// Pad state handed to the plugin while pad_replay is set, from the pad events of a stream
+static bool pad_replay = false;
+static unsigned int pad_buttons = 0;
+static int pad_error = 0;
+
+// Virtual time in microseconds, handed to the plugin in place of both of its clocks while virtual_clock is set
+static bool virtual_clock = false;
+static unsigned int virtual_time_us = BENCH_CLOCK_START_US;
+
+// A press blocked without the combo and released, then a press with the combo that suspends and resumes.
+// It's only timed, so no virtual time passes between the events.
+static const bench_event synthetic_stream[] = {
+#ifdef BENCH_HOLD
+    { BENCH_EVENT_CALLBACK, BENCH_BATTERY | PSP_POWER_CB_HOLD_SWITCH },
+    { BENCH_EVENT_CALLBACK, BENCH_BATTERY },
+#endif
+    { BENCH_EVENT_PAD, 0 },
+    { BENCH_EVENT_CALLBACK, BENCH_BATTERY | PSP_POWER_CB_POWER_SWITCH },
+    { BENCH_EVENT_SYSEVENT, SCE_SYSTEM_SUSPEND_EVENT_QUERY },
+    { BENCH_EVENT_SYSEVENT, SCE_SYSTEM_SUSPEND_EVENT_QUERY },
+    { BENCH_EVENT_CALLBACK, BENCH_BATTERY },
+    { BENCH_EVENT_PAD, BUTTON_COMBO_MASK },
+    { BENCH_EVENT_CALLBACK, BENCH_BATTERY | PSP_POWER_CB_POWER_SWITCH },
+    { BENCH_EVENT_SYSEVENT, SCE_SYSTEM_SUSPEND_EVENT_QUERY },
+    { BENCH_EVENT_SYSEVENT, SCE_SYSTEM_SUSPEND_EVENT_START },
+    { BENCH_EVENT_SYSEVENT, SCE_SYSTEM_RESUME_EVENT_COMPLETED },
+    { BENCH_EVENT_CALLBACK, BENCH_BATTERY | PSP_POWER_CB_RESUME_COMPLETE },
+    { BENCH_EVENT_CALLBACK, BENCH_BATTERY },
+};
+
+// Loaded from BENCH_STREAM_PATH, empty if there isn't one
+static bench_event recorded_stream[BENCH_STREAM_MAX];
+static unsigned int recorded_length = 0;
+
+static FILE *json_file = NULL;
+static bool json_first = true;
+
+// Sorted sample times for one scenario, in microseconds per batch
+static unsigned int samples[BENCH_SAMPLES];
+
+// Dirtied before each cold call, so the handler's data misses and every line it fills writes back one of these first
+static unsigned char evict_data[BENCH_EVICT_SIZE] __attribute__((aligned(KS_CACHE_LINE)));
+
+// BENCH_EVICT_SIZE of straight line code, run before each cold call to push the handlers out of the I-cache
+__attribute__((noinline)) static void bench_evict_code(void)
+{
+    __asm__ volatile(".rept " xstr(BENCH_EVICT_SIZE / 4) "\n\tnop\n\t.endr");
+}
+
+// Evict both caches, in the cold pass. Call it after setting up the state for the call.
+// Done with plain loads, stores and code instead of the cache flush syscalls, so the handler's misses cost what they
+// would after the game ran: the data lines it needs have been replaced by dirty ones, not just invalidated.
+static void bench_cold(void)
+{
+    if(cold_cache) {
+        unsigned int i;
+        for(i = 0; i < BENCH_EVICT_SIZE; i += KS_CACHE_LINE) {
+            evict_data[i]++;
+        }
+        bench_evict_code();
+    }
+}
+
+// Loop and call overhead, subtracted from every scenario. The cold pass includes the eviction too.
+static void bench_empty(unsigned int i)
+{
+    bench_cold();
+    sink += i;
+}
+
+static void bench_query_allowed(unsigned int i)
+{
+    ks_hot.allow_sleep = true;
+    bench_cold();
+    sink += killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_QUERY, "query", NULL, NULL);
+}
+
+static void bench_query_blocked(unsigned int i)
+{
+    ks_hot.allow_sleep = false;
+    ks_hot.consecutive_sleep_blocks = 0;
+    bench_cold();
+    sink += killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_QUERY, "query", NULL, NULL);
+}
+
+static void bench_query_failsafe(unsigned int i)
+{
+    ks_hot.allow_sleep = false;
+    ks_hot.consecutive_sleep_blocks = MAX_CONSECUTIVE_SLEEPS;
+    bench_cold();
+    sink += killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_QUERY, "query", NULL, NULL);
+}
+
+static void bench_suspend_start(unsigned int i)
+{
+    bench_cold();
+    sink += killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_START, "start", NULL, NULL);
+}
+
+#if !KS_CONFIG_THREADLESS
+// The callbacks are given changed flags each time, so they don't take the collapsed callback path
+static void bench_callback_switch_pressed(unsigned int i)
+{
+    ks_hot.last_pwrflags = 0;
+    bench_cold();
+    sink += power_callback_handler(0, PSP_POWER_CB_POWER_SWITCH, NULL);
+}
+
+static void bench_callback_switch_released(unsigned int i)
+{
+    ks_hot.allow_sleep = false;
+    ks_hot.last_pwrflags = PSP_POWER_CB_POWER_SWITCH;
+    bench_cold();
+    sink += power_callback_handler(0, 0, NULL);
+}
+
+static void bench_callback_other(unsigned int i)
+{
+    bench_cold();
+    sink += power_callback_handler(0, PSP_POWER_CB_BATTERY_EXIST | (i & PSP_POWER_CB_BATTPOWER), NULL);
+}
+
+#ifdef BENCH_HOLD
+static void bench_callback_hold_toggle(unsigned int i)
+{
+    // Every toggle is past the debounce
+    ks_hot.hold_edge_timestamp = 0;
+    bench_cold();
+    sink += power_callback_handler(0, (i & 1) ? PSP_POWER_CB_HOLD_SWITCH : 0, NULL);
+}
+
+static void bench_callback_hold_lockout(unsigned int i)
+{
+    ks_hot.hold_active = true;
+    ks_hot.hold_edge_timestamp = 0;
+    power_callback_handler(0, 0, NULL);
+    bench_cold();
+    sink += power_callback_handler(0, PSP_POWER_CB_POWER_SWITCH, NULL);
+}
+#endif
+#endif // !KS_CONFIG_THREADLESS
+
+static unsigned int bench_time_low(void)
+{
+    return virtual_clock ? virtual_time_us : sceKernelGetSystemTimeLow();
+}
+
+static clock_t bench_libc_clock(void)
+{
+    return virtual_clock ? (clock_t)virtual_time_us : sceKernelLibcClock();
+}
+
+static int bench_ctrl_peek(SceCtrlData *pad_data, int count)
+{
+    if(!pad_replay) {
+        return sceCtrlPeekBufferPositive(pad_data, count);
+    }
+    if(pad_error < 0) {
+        return pad_error;
+    }
+    pad_data->TimeStamp = 0;
+    pad_data->Buttons = pad_buttons;
+    pad_data->Lx = 128;
+    pad_data->Ly = 128;
+    return count;
+}
+
+// Clear what the timed scenarios left behind, eg a hold lockout still running
+static void reset_state(void)
+{
+    virtual_time_us = BENCH_CLOCK_START_US;
+    ks_hot.allow_sleep = true;
+    ks_hot.consecutive_sleep_blocks = 0;
+    ks_hot.battery_critical = false;
+    ks_hot.suspend_in_progress = false;
+    ks_hot.query_retry = false;
+    ks_hot.last_pwrflags = 0;
+#ifdef BENCH_HOLD
+    ks_hot.hold_active = false;
+    ks_hot.hold_release_timestamp = 0;
+    ks_hot.hold_edge_timestamp = 0;
+    ks_hot.hold_bounce_timestamp = 0;
+#else
+    // The threadless variant's next query is a new request
+    ks_hot.last_query_time = bench_time_low() - QUERY_RETRY_GAP_US;
+#endif
+    pad_buttons = 0;
+    pad_error = 0;
+}
+
+// Returns what the handler returned, 0 for pad events
+static int replay_event(const bench_event *event)
+{
+    virtual_time_us += event->delay_us;
+    switch(event->kind) {
+    case BENCH_EVENT_PAD:
+        // Pad read errors are negative, button masks never are
+        pad_error = ((int)event->value < 0) ? (int)event->value : 0;
+        pad_buttons = (pad_error < 0) ? 0 : event->value;
+        break;
+#if !KS_CONFIG_THREADLESS
+    case BENCH_EVENT_CALLBACK:
+        return power_callback_handler(0, (int)event->value, NULL);
+#endif
+    case BENCH_EVENT_SYSEVENT:
+        return killswitchSysEventHandler((int)event->value, "stream", NULL, NULL);
+    }
+    return 0;
+}
+
+// The stream position carries on across calls and batches, so every event is timed in turn
+static void bench_stream_synthetic(unsigned int i)
+{
+    static unsigned int position = 0;
+    const bench_event *event = &synthetic_stream[position];
+    if(++position == sizeof(synthetic_stream) / sizeof(synthetic_stream[0])) {
+        position = 0;
+    }
+    bench_cold();
+    sink += replay_event(event);
+}
+
+static void bench_stream_recorded(unsigned int i)
+{
+    static unsigned int position = 0;
+    const bench_event *event = &recorded_stream[position];
+    if(++position == recorded_length) {
+        position = 0;
+    }
+    bench_cold();
+    sink += replay_event(event);
+}
+
+// One "<pad|cb|ev> <hex value> [<hex delay in us>]" per line, as written by tools/ks_trace2stream.py
+static void load_recorded_stream(void)
+{
+    char line[64];
+    char kind[8];
+    unsigned int value;
+    unsigned int delay_us;
+
+    FILE *f = fopen(BENCH_STREAM_PATH, "r");
+    if(f == NULL) {
+        return;
+    }
+    while(recorded_length < BENCH_STREAM_MAX && fgets(line, sizeof(line), f) != NULL) {
+        int fields = sscanf(line, "%7s %x %x", kind, &value, &delay_us);
+        if(fields < 2) {
+            continue;
+        }
+        bench_event *event = &recorded_stream[recorded_length];
+        if(strcmp(kind, "pad") == 0) {
+            event->kind = BENCH_EVENT_PAD;
+        }
+        else if(strcmp(kind, "cb") == 0) {
+            event->kind = BENCH_EVENT_CALLBACK;
+        }
+        else if(strcmp(kind, "ev") == 0) {
+            event->kind = BENCH_EVENT_SYSEVENT;
+        }
+        else {
+            continue;
+        }
+        event->value = value;
+        event->delay_us = (fields == 3) ? delay_us : BENCH_EVENT_STEP_US;
+        recorded_length++;
+    }
+    fclose(f);
+}
+
+static const bench_scenario scenarios[] = {
+    { "query allowed", bench_query_allowed },
+    { "query blocked", bench_query_blocked },
+    { "query failsafe", bench_query_failsafe },
+    { "suspend start", bench_suspend_start },
+#if !KS_CONFIG_THREADLESS
+    { "cb switch pressed", bench_callback_switch_pressed },
+    { "cb switch released", bench_callback_switch_released },
+    { "cb other flags", bench_callback_other },
+#ifdef BENCH_HOLD
+    { "cb hold toggle", bench_callback_hold_toggle },
+    { "cb hold+switch", bench_callback_hold_lockout },
+#endif
+#endif
+    { "stream synthetic", bench_stream_synthetic, true },
+    { "stream recorded", bench_stream_recorded, true },
+};
+
+// Decision log, to compare the decisions of two builds of a plugin with tools/ks_benchdiff.py.
+// A seeded random stream is replayed, then the recorded stream if there is one, and every event is written out with
+// what the handler returned and the state it left. The random stream starts from a clean state every
+// BENCH_RANDOM_SEGMENT events, so any difference can be reproduced from the segment it's in.
+// The plugin's clocks only move by the delay of each event, so the timed rules (debounce, lockout, idle and retry
+// windows) see exactly the same times in every run, however long the handlers or writing the log take.
+#define BENCH_DECISIONS_PATH MODULE_NAME "Bench.decisions"
+#define BENCH_RANDOM_EVENTS 4096
+#define BENCH_RANDOM_SEGMENT 128
+#define BENCH_RANDOM_SEED 0x4B53u
+
+static const char *const event_kinds[] = { "pad", "cb", "ev" };
+
+static unsigned int random_state;
+static unsigned int query_burst;
+
+// xorshift32, the same sequence in every build
+static unsigned int next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static bench_event random_event(void)
+{
+    static const unsigned int pads[] = {
+        0, 0, BUTTON_COMBO_MASK, BUTTON_COMBO_MASK | PSP_CTRL_CROSS, PSP_CTRL_CROSS, 0x80000023,
+    };
+    static const unsigned int sysevents[] = {
+        SCE_SYSTEM_SUSPEND_EVENT_QUERY, SCE_SYSTEM_SUSPEND_EVENT_QUERY, SCE_SYSTEM_SUSPEND_EVENT_QUERY,
+        SCE_SYSTEM_SUSPEND_EVENT_CANCELLATION, SCE_SYSTEM_SUSPEND_EVENT_START, SCE_SYSTEM_RESUME_EVENT_COMPLETED,
+    };
+    // From back to back up to past the lockout and retry windows
+    static const unsigned int delays_us[] = {
+        1000, 1000, 5000, 20000, 100000, 500000, 2000000, 3000000,
+    };
+    bench_event event;
+    unsigned int r = next_random();
+
+    // Now and then the power service retries a query until the failsafe trips
+    if(query_burst > 0) {
+        query_burst--;
+        event.kind = BENCH_EVENT_SYSEVENT;
+        event.value = SCE_SYSTEM_SUSPEND_EVENT_QUERY;
+        event.delay_us = BENCH_EVENT_STEP_US;
+        return event;
+    }
+    event.delay_us = delays_us[(r >> 20) % (sizeof(delays_us) / sizeof(delays_us[0]))];
+    if((r >> 12) % 32 == 0) {
+        query_burst = MAX_CONSECUTIVE_SLEEPS;
+    }
+
+    switch(r % 3) {
+    case 0:
+        event.kind = BENCH_EVENT_PAD;
+        event.value = pads[(r >> 2) % (sizeof(pads) / sizeof(pads[0]))];
+        break;
+    case 1:
+        // Random switch and hold levels, now and then a resume or a nearly flat battery
+        event.kind = BENCH_EVENT_CALLBACK;
+        event.value = PSP_POWER_CB_BATTERY_EXIST
+            | (((r >> 2) & 1) ? PSP_POWER_CB_POWER_SWITCH : 0)
+            | (((r >> 3) & 1) ? PSP_POWER_CB_HOLD_SWITCH : 0)
+            | ((((r >> 4) & 15) == 0) ? PSP_POWER_CB_RESUME_COMPLETE : 0)
+            | ((((r >> 8) & 15) == 0) ? 3 : 80);
+        break;
+    default:
+        event.kind = BENCH_EVENT_SYSEVENT;
+        event.value = sysevents[(r >> 2) % (sizeof(sysevents) / sizeof(sysevents[0]))];
+        break;
+    }
+    return event;
+}
+
+static void log_decision(FILE *f, const char *stream, unsigned int index, const bench_event *event, int ret)
+{
+    fprintf(f, "%s %u %s %08x %x -> %08x allow %i blocks %i", stream, index, event_kinds[event->kind], event->value,
+        event->delay_us, (unsigned int)ret, ks_hot.allow_sleep, ks_hot.consecutive_sleep_blocks);
+#ifdef BENCH_HOLD
+    fprintf(f, " hold %i", ks_hot.hold_active);
+#endif
+    fprintf(f, "\n");
+}
+
+static void write_decisions(void)
+{
+    unsigned int n;
+
+    FILE *f = fopen(BENCH_DECISIONS_PATH, "w");
+    if(f == NULL) {
+        return;
+    }
+
+    pad_replay = true;
+    virtual_clock = true;
+    random_state = BENCH_RANDOM_SEED;
+    for(n = 0; n < BENCH_RANDOM_EVENTS; n++) {
+        if(n % BENCH_RANDOM_SEGMENT == 0) {
+            reset_state();
+            query_burst = 0;
+            fprintf(f, "random %u reset\n", n);
+        }
+        bench_event event = random_event();
+        log_decision(f, "random", n, &event, replay_event(&event));
+    }
+
+    reset_state();
+    fprintf(f, "recorded 0 reset\n");
+    for(n = 0; n < recorded_length; n++) {
+        log_decision(f, "recorded", n, &recorded_stream[n], replay_event(&recorded_stream[n]));
+    }
+
+    fclose(f);
+    pad_replay = false;
+    virtual_clock = false;
+    reset_state();
+    BENCH_PRINT("Decisions written to " BENCH_DECISIONS_PATH "\n");
+}
+
+// The fault checks drive the power callback, which the threadless variant doesn't have
+#if defined(KILLSWITCH_FAULTS) && !KS_CONFIG_THREADLESS
+#define BENCH_FAULT_CHECKS
+#endif
+
+#ifdef BENCH_FAULT_CHECKS
+static int check_failures = 0;
+
+static void check(const char *name, bool ok)
+{
+    BENCH_PRINT("%-44s %s\n", name, ok ? "ok" : "FAILED");
+    if(!ok) {
+        check_failures++;
+    }
+}
+
+// Press the power switch so that it's blocked, and return the suspend query result
+static int press_blocked(void)
+{
+    reset_state();
+#ifdef BENCH_HOLD
+    // Release hold just before the press
+    ks_hot.hold_active = true;
+    ks_hot.last_pwrflags = PSP_POWER_CB_HOLD_SWITCH;
+    power_callback_handler(0, 0, NULL);
+#endif
+    // Without the combo held
+    power_callback_handler(0, PSP_POWER_CB_POWER_SWITCH, NULL);
+    return killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_QUERY, "query", NULL, NULL);
+}
+
+static void run_fault_checks(void)
+{
+    KsFault pad_fails = { .every = 1, .error = 0x80000023 };
+    KsFault pad_stalls = { .delay_us = 1000 };
+    int n;
+
+    BENCH_PRINT("\nFault injection\n");
+
+    // The pad is only read for the combo, a failed read has to fail open rather than block every press
+    ks_fault_reset();
+    ks_fault_set(KS_FAULT_CTRL_PEEK, &pad_fails);
+    reset_state();
+    ks_hot.allow_sleep = false;
+    power_callback_handler(0, PSP_POWER_CB_POWER_SWITCH, NULL);
+    int query_ret = killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_QUERY, "query", NULL, NULL);
+#ifdef BENCH_HOLD
+    check("pad failing: no effect outside lockout", query_ret == SCE_ERROR_OK);
+#else
+    check("pad failing: press allowed", query_ret == SCE_ERROR_OK && ks_hot.allow_sleep);
+#endif
+
+    // However long it's blocked, the failsafe lets the suspend through
+    ks_fault_reset();
+    query_ret = press_blocked();
+    for(n = 1; query_ret != SCE_ERROR_OK && n <= MAX_CONSECUTIVE_SLEEPS; n++) {
+        query_ret = killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_QUERY, "query", NULL, NULL);
+    }
+    check("blocked press: failsafe after " xstr(MAX_CONSECUTIVE_SLEEPS) " queries",
+        query_ret == SCE_ERROR_OK && n == MAX_CONSECUTIVE_SLEEPS + 1);
+
+    // The switch being released ends the block even if the pad is gone by then
+    press_blocked();
+    ks_fault_set(KS_FAULT_CTRL_PEEK, &pad_fails);
+    power_callback_handler(0, 0, NULL);
+    query_ret = killswitchSysEventHandler(SCE_SYSTEM_SUSPEND_EVENT_QUERY, "query", NULL, NULL);
+    check("blocked press: release allows, pad failing", query_ret == SCE_ERROR_OK);
+
+    // Decision latency with a pad read that takes 1ms
+    ks_fault_reset();
+    ks_fault_set(KS_FAULT_CTRL_PEEK, &pad_stalls);
+    reset_state();
+    unsigned int start = sceKernelGetSystemTimeLow();
+    power_callback_handler(0, PSP_POWER_CB_POWER_SWITCH, NULL);
+    unsigned int decision_us = sceKernelGetSystemTimeLow() - start;
+    BENCH_PRINT("%-44s %uus\n", "press decision, pad read +1000us", decision_us);
+
+    ks_fault_reset();
+    reset_state();
+    BENCH_PRINT("%i check(s) failed\n", check_failures);
+}
+#endif
+
+static void sort_samples(void)
+{
+    int i, j;
+    for(i = 1; i < BENCH_SAMPLES; i++) {
+        unsigned int v = samples[i];
+        for(j = i; j > 0 && samples[j - 1] > v; j--) {
+            samples[j] = samples[j - 1];
+        }
+        samples[j] = v;
+    }
+}
+
+static void run_samples(bench_fn fn, unsigned int batch)
+{
+    int s;
+    unsigned int i;
+    for(s = 0; s < BENCH_SAMPLES; s++) {
+        unsigned int start = sceKernelGetSystemTimeLow();
+        for(i = 0; i < batch; i++) {
+            fn(i);
+        }
+        samples[s] = sceKernelGetSystemTimeLow() - start;
+    }
+    sort_samples();
+}
+
+// Convert microseconds per batch into hundredths of a cycle per call
+static unsigned int batch_to_centicycles(unsigned int batch_us, unsigned int baseline_us, int cpu_mhz, unsigned int batch)
+{
+    unsigned int us = (batch_us > baseline_us) ? (batch_us - baseline_us) : 0;
+    return (unsigned int)(((unsigned long long)us * cpu_mhz * 100) / batch);
+}
+
+// Every sample of one scenario, in hundredths of a cycle per call, for tools/ks_benchcompare.py
+static void json_result(const char *pass, const char *name, unsigned int baseline_us, int cpu_mhz, unsigned int batch)
+{
+    int s;
+
+    if(json_file == NULL) {
+        return;
+    }
+    fprintf(json_file, "%s\n    {\"pass\": \"%s\", \"name\": \"%s\", \"calls\": %u, \"samples\": [",
+        json_first ? "" : ",", pass, name, BENCH_SAMPLES * batch);
+    for(s = 0; s < BENCH_SAMPLES; s++) {
+        fprintf(json_file, "%s%u", (s == 0) ? "" : ", ", batch_to_centicycles(samples[s], baseline_us, cpu_mhz, batch));
+    }
+    fprintf(json_file, "]}");
+    json_first = false;
+}
+
+static void run_scenarios(const char *pass, int cpu_mhz, unsigned int batch)
+{
+    unsigned int n;
+
+    // Each stream starts from nothing held, whatever the last one left behind
+    pad_buttons = 0;
+    pad_error = 0;
+
+    run_samples(bench_empty, batch);
+    unsigned int baseline_us = samples[0];
+
+    for(n = 0; n < sizeof(scenarios) / sizeof(scenarios[0]); n++) {
+        if(scenarios[n].fn == bench_stream_recorded && recorded_length == 0) {
+            continue;
+        }
+        pad_replay = scenarios[n].stream;
+        run_samples(scenarios[n].fn, batch);
+        pad_replay = false;
+        json_result(pass, scenarios[n].name, baseline_us, cpu_mhz, batch);
+
+        unsigned int lo = batch_to_centicycles(samples[0], baseline_us, cpu_mhz, batch);
+        unsigned int med = batch_to_centicycles(samples[BENCH_SAMPLES / 2], baseline_us, cpu_mhz, batch);
+        unsigned int hi = batch_to_centicycles(samples[BENCH_SAMPLES - 1], baseline_us, cpu_mhz, batch);
+
+        BENCH_PRINT("%-20s %4u.%02u %4u.%02u %4u.%02u\n", scenarios[n].name,
+            lo / 100, lo % 100, med / 100, med % 100, hi / 100, hi % 100);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int cpu_mhz = scePowerGetCpuClockFrequencyInt();
+
+    pspDebugScreenInit();
+    BENCH_PRINT(MODULE_NAME " v" xstr(MAJOR_VER) "." xstr(MINOR_VER) " handler bench @ %iMHz\n", cpu_mhz);
+    BENCH_PRINT("Cycles per call (min/median/max)\n");
+
+#if defined(KILLSWITCH_POLICY)
+    if(ks_policy_load(MODULE_NAME) > 0) {
+        BENCH_PRINT("Policy program loaded from ms0:/SEPLUGINS/" MODULE_NAME ".kpol\n");
+    }
+#endif
+
+    load_recorded_stream();
+    if(recorded_length > 0) {
+        BENCH_PRINT("Recorded stream: %u events from " BENCH_STREAM_PATH "\n", recorded_length);
+    }
+    write_decisions();
+
+    json_file = fopen(BENCH_JSON_PATH, "w");
+    if(json_file != NULL) {
+        fprintf(json_file, "{\n  \"module\": \"" MODULE_NAME "\",\n  \"version\": \"" xstr(MAJOR_VER) "." xstr(MINOR_VER) "\",\n");
+        fprintf(json_file, "  \"cpu_mhz\": %i,\n  \"unit\": \"centicycles\",\n  \"results\": [", cpu_mhz);
+    }
+
+    BENCH_PRINT("\nWarm caches, %u calls per scenario\n", BENCH_SAMPLES * BENCH_BATCH);
+    run_scenarios("warm", cpu_mhz, BENCH_BATCH);
+
+    cold_cache = true;
+    BENCH_PRINT("\nCold caches, %u calls per scenario\n", BENCH_SAMPLES * BENCH_COLD_BATCH);
+    run_scenarios("cold", cpu_mhz, BENCH_COLD_BATCH);
+    cold_cache = false;
+
+    if(json_file != NULL) {
+        fprintf(json_file, "\n  ]\n}\n");
+        fclose(json_file);
+        BENCH_PRINT("\nSamples written to " BENCH_JSON_PATH "\n");
+    }
+
+#ifdef BENCH_FAULT_CHECKS
+    run_fault_checks();
+#endif
+
+    BENCH_PRINT("\nDone (%i).\n", sink & 1);
+
+    sceKernelSleepThread();
+    return 0;
+}
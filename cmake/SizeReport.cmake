@@ -0,0 +1,84 @@
+# Reports the section sizes of the plugin modules, appends them to the size history and enforces the size budget.
+#
+# Run by the size_report target:
+#   SIZE_TOOL  - psp-size
+#   CONFIG     - build type the modules were built with
+#   BUDGET     - text,data,bss,rodata budget in bytes, 0 to disable a section
+#   HISTORY    - csv file to append the report to
+#   SOURCE_DIR - source tree, used to find the current commit
+#   MODULES    - name=path,name=path list of module ELFs
+
+cmake_minimum_required(VERSION 3.13)
+
+if(NOT SIZE_TOOL)
+    message(FATAL_ERROR "psp-size not found, is PSPDEV set?")
+endif()
+
+set(SECTIONS text data bss rodata)
+string(REPLACE "," ";" BUDGET "${BUDGET}")
+string(REPLACE "," ";" MODULES "${MODULES}")
+
+find_package(Git QUIET)
+set(COMMIT "unknown")
+if(GIT_FOUND)
+    execute_process(
+        COMMAND ${GIT_EXECUTABLE} rev-parse --short HEAD
+        WORKING_DIRECTORY ${SOURCE_DIR}
+        OUTPUT_VARIABLE COMMIT
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+        ERROR_QUIET
+    )
+endif()
+string(TIMESTAMP DATE "%Y-%m-%d" UTC)
+
+if(NOT EXISTS ${HISTORY})
+    file(WRITE ${HISTORY} "date,commit,config,module,text,data,bss,rodata\n")
+endif()
+
+set(OVER_BUDGET "")
+
+foreach(module ${MODULES})
+    string(REGEX REPLACE "=.*$" "" name "${module}")
+    string(REGEX REPLACE "^[^=]*=" "" path "${module}")
+
+    execute_process(
+        COMMAND ${SIZE_TOOL} -A ${path}
+        OUTPUT_VARIABLE size_output
+        RESULT_VARIABLE size_result
+    )
+    if(NOT size_result EQUAL 0)
+        message(FATAL_ERROR "${SIZE_TOOL} failed on ${path}")
+    endif()
+
+    # psp-size -A prints "section size addr", sum every output section with a matching prefix
+    # (eg .rodata.sceModuleInfo counts towards .rodata)
+    foreach(section ${SECTIONS})
+        set(${section}_size 0)
+    endforeach()
+    string(REPLACE "\n" ";" size_lines "${size_output}")
+    foreach(line ${size_lines})
+        if(line MATCHES "^\\.([a-z]+)[^ \t]*[ \t]+([0-9]+)")
+            set(section ${CMAKE_MATCH_1})
+            if(section IN_LIST SECTIONS)
+                math(EXPR ${section}_size "${${section}_size} + ${CMAKE_MATCH_2}")
+            endif()
+        endif()
+    endforeach()
+
+    message(STATUS "${name} (${CONFIG}): .text ${text_size}  .data ${data_size}  .bss ${bss_size}  .rodata ${rodata_size}")
+    file(APPEND ${HISTORY} "${DATE},${COMMIT},${CONFIG},${name},${text_size},${data_size},${bss_size},${rodata_size}\n")
+
+    set(index 0)
+    foreach(section ${SECTIONS})
+        list(GET BUDGET ${index} budget)
+        if(budget GREATER 0 AND ${section}_size GREATER budget)
+            list(APPEND OVER_BUDGET "${name} .${section} ${${section}_size} > ${budget}")
+        endif()
+        math(EXPR index "${index} + 1")
+    endforeach()
+endforeach()
+
+if(OVER_BUDGET)
+    string(REPLACE ";" "\n  " OVER_BUDGET "${OVER_BUDGET}")
+    message(FATAL_ERROR "Size budget exceeded:\n  ${OVER_BUDGET}")
+endif()
@@ -3,11 +3,6 @@
 //
 // Ryan Crosby 2025
 
-#ifdef DEBUG
-#include <pspdebug.h>
-#include <pspdisplay.h>
-#endif
-
 #include <pspsdk.h>
 #include <psppower.h>
 #include <pspsysevent.h>
@@ -16,22 +11,70 @@
 
 #include <stdbool.h>
 
+#include "ks_config.h"
+#include "ks_layout.h"
+#include "ks_log.h"
+#include "ks_stats.h"
+#include "ks_statdev.h"
+#include "ks_persist.h"
+#include "ks_poll.h"
+#include "ks_overlay.h"
+#include "ks_led.h"
+#include "ks_fault.h"
+#include "ks_policy.h"
+
 #define str(s) #s // For stringizing defines
 #define xstr(s) str(s)
 
-#ifdef DEBUG
-#define DEBUG_PRINT(...) pspDebugScreenKprintf( __VA_ARGS__ )
-#else
-#define DEBUG_PRINT(...) do{ } while ( 0 )
-#endif
+// Policy settings come from the generated ks_config.h, see ks_config.h.in and the KILLSWITCH_* CMake cache variables
 
 // Allow the switch to work when this button combo is pressed
-// Hold HOME + Power Switch to sleep.
-// See https://pspdev.github.io/pspsdk/group__Ctrl.html#gac080131ea3904c97efb6c31b1c4deb10 for button constants
-#define BUTTON_COMBO_MASK PSP_CTRL_HOME
-#define MAX_CONSECUTIVE_SLEEPS 10
+// Hold HOME + Power Switch to sleep by default.
+#define BUTTON_COMBO_MASK KS_CONFIG_BUTTON_COMBO_MASK
+#define MAX_CONSECUTIVE_SLEEPS KS_CONFIG_MAX_CONSECUTIVE_SLEEPS
+
+// Always allow sleep when running on a battery at or below this charge, rather than risk it running flat while blocked
+#define LOW_BATTERY_PERCENT KS_CONFIG_LOW_BATTERY_PERCENT
+
+// Allow sleep without the combo when there's been no pad input for this long, the player isn't playing. 0 disables.
+// The threadless variant has nothing to sample the pad with.
+#if KS_CONFIG_THREADLESS
+#define IDLE_ALLOW_MS 0
+#else
+#define IDLE_ALLOW_MS KS_CONFIG_IDLE_ALLOW_MS
+#endif
+#define IDLE_ALLOW_US (IDLE_ALLOW_MS * 1000)
+// How often the pad is sampled for input while the idle policy is enabled
+#define IDLE_SAMPLE_US (500 * 1000)
+// Analog stick movement smaller than this is noise
+#define IDLE_ANALOG_DEADZONE 32
+
+#define MODULE_NAME KS_CONFIG_MODULE_NAME
+
+// Stats device, read "ks0:" to get the KsStatsRecord
+#define STATS_DEVICE_NAME "ks"
+
+// Lifetime stats are saved to ms0:/SEPLUGINS/<MODULE_NAME>.stats after each resume and at most this often otherwise
+#define PERSIST_INTERVAL_US (10 * 60 * 1000 * 1000)
+
+// Callback thread event flag bits
+#define CALLBACK_EVENT_STOP     0x00000001 // module_stop, clean up and exit
+#define CALLBACK_EVENT_PERSIST  0x00000002 // Save the lifetime stats
+#define CALLBACK_EVENT_POLL     0x00000004 // Polling fallback, poll the power state
+#define CALLBACK_EVENT_RESUMED  0x00000008 // Polling fallback, resumed from a suspend
+#define CALLBACK_EVENT_SAMPLE   0x00000010 // Idle policy, sample the pad for input
+#define CALLBACK_EVENT_LED      0x00000020 // Next step of the LED blink
+
+// Polling fallback, used when there's no free power callback slot
+#define POLL_FAST_US (20 * 1000)            // While a decision depends on the power state
+#define POLL_IDLE_US (1000 * 1000)          // Otherwise
+#define POLL_QUERY_WINDOW_US (2000 * 1000)  // Poll fast for this long after a suspend query the poller hadn't seen
+
+// Threadless variant, a suspend query this long after the last one is a new request rather than a retry
+#define QUERY_RETRY_GAP_US (2000 * 1000)
+// Threadless variant, how often the battery state is refreshed in place of the power callback
+#define BATTERY_REFRESH_US (5 * 1000 * 1000)
 
-#define MODULE_NAME "KillSwitch"
 #define MAJOR_VER 1
 #define MINOR_VER 3
 
@@ -47,7 +90,10 @@
 #define SCE_SYSTEM_SUSPEND_EVENT_QUERY              0x00000100
 #define SCE_SYSTEM_SUSPEND_EVENT_CANCELLATION       0x00000101
 #define SCE_SYSTEM_SUSPEND_EVENT_START              0x00000102
+#define SCE_RESUME_EVENTS                           0x00FF0000
+#define SCE_SYSTEM_RESUME_EVENT_COMPLETED           0x00400000
 
+#ifndef KILLSWITCH_BENCH
 // We are building a kernel mode prx plugin
 PSP_MODULE_INFO(MODULE_NAME, PSP_MODULE_KERNEL, MAJOR_VER, MINOR_VER);
 
@@ -62,19 +108,62 @@ PSP_NO_CREATE_MAIN_THREAD();
 
 // We don't need any of the newlib features since we're not calling into stdio or stdlib etc
 PSP_DISABLE_NEWLIB();
+#endif
 
 static int killswitchSysEventHandler(int ev_id, char *ev_name, void *param, int *result);
+#if !KS_CONFIG_THREADLESS
 static int power_callback_handler(int unknown, int pwrflags, void *common);
+#endif
+
+// State used on the switch and suspend path, kept together in one cache line, see ks_layout.h
+typedef struct {
+    int consecutive_sleep_blocks;
+    int callback_evid;
+    unsigned int switch_press_time;
+    unsigned int last_input_time;   // Idle policy, sceKernelGetSystemTimeLow() of the last pad input seen
+
+    // Power event sequence accounting, to spot callbacks that were collapsed or arrived too late
+    int last_pwrflags;
+    unsigned int callback_seq;      // Power callbacks handled, not counting the first one after a resume
+    unsigned int query_seq;         // callback_seq at the last suspend query
+    unsigned int last_query_time;   // Threadless variant, sceKernelGetSystemTimeLow() of the last suspend query
+
+    bool allow_sleep;
+    bool suspend_in_progress;
+    bool switch_press_pending;
+    bool battery_critical;          // Cached from the power callback flags (an alarm when threadless), so queries don't ask
+    bool query_retry;               // A suspend was cancelled, queries can repeat without a new callback
+    bool power_polling;             // Polling fallback in use
+} KsHotState;
+_Static_assert(sizeof(KsHotState) <= KS_CACHE_LINE, "KsHotState must fit in one cache line");
+
+KsHotState ks_hot KS_HOT_STATE = {
+    .callback_evid = -1,
+    .allow_sleep = true,
+};
 
-bool allow_sleep = true;
-int consecutive_sleep_blocks = 0;
 int callback_thid = -1;
 
+KsStatsRecord ks_record;
+
+// Idle policy, the pad state at the last input seen by the callback thread
+SceCtrlData last_input_pad;
+unsigned int last_input_makes = 0;
+
+// Polling fallback state
+bool poll_query_pending = false;
+unsigned int poll_query_time = 0;
+bool poll_sample_pending = false;   // A query was blocked for the poller, and it hasn't read the state since
+
 // Our PspSysEventHandler to receive the power switch event
 PspSysEventHandler sys_event = {
     .size = sizeof(PspSysEventHandler),
     .name = "sce" MODULE_NAME, // Arbitrary string, doesn't appear to be used for anything
+#if KS_CONFIG_THREADLESS
     .type_mask = SCE_SUSPEND_EVENTS,
+#else
+    .type_mask = SCE_SUSPEND_EVENTS | SCE_RESUME_EVENTS, // Resume events are only used by the polling fallback
+#endif
     .handler = killswitchSysEventHandler,
     .r28 = 0,
     .busy = 0,
@@ -92,73 +181,286 @@ PspSysEventHandler sys_event = {
     }
 };
 
-int killswitchSysEventHandler(int ev_id, char *ev_name, void *param, int *result)
+#if defined(KILLSWITCH_POLICY)
+// Run the policy program on a power switch press, if one was loaded. Returns true if it decided the press.
+static KS_HOT bool policy_decide(int pad_ret, unsigned int buttons)
+{
+    if(!ks_policy_active()) {
+        return false;
+    }
+    // Without the pad the press is allowed whatever the program says, so leave it to the plugin's own rules
+    if(KS_UNLIKELY(pad_ret < 0)) {
+        return false;
+    }
+
+    unsigned int inputs[KS_POLICY_INPUT_COUNT];
+    inputs[KS_POLICY_IN_BUTTONS] = buttons;
+    inputs[KS_POLICY_IN_PAD_ERROR] = 0;
+    inputs[KS_POLICY_IN_IDLE_MS] = (IDLE_ALLOW_MS > 0) ? (sceKernelGetSystemTimeLow() - ks_hot.last_input_time) / 1000 : 0;
+    inputs[KS_POLICY_IN_HOLD_RELEASE_MS] = 0xFFFFFFFF;
+    inputs[KS_POLICY_IN_HOLD] = (buttons & PSP_CTRL_HOLD) != 0;
+    // From the last callback, or in the threadless variant the battery alarm, so there's no power service call here
+    inputs[KS_POLICY_IN_BATTERY] = (ks_hot.last_pwrflags & PSP_POWER_CB_BATTERY_EXIST)
+        ? (ks_hot.last_pwrflags & PSP_POWER_CB_BATTPOWER) : 0;
+    inputs[KS_POLICY_IN_AC] = (ks_hot.last_pwrflags & PSP_POWER_CB_AC_POWER) != 0;
+    inputs[KS_POLICY_IN_LOW_BATTERY] = ks_hot.battery_critical;
+
+    int verdict = ks_policy_eval(inputs);
+    if(verdict == KS_POLICY_ALLOW) {
+        DEBUG_PRINT("Policy allowed sleep\n");
+        KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_POLICY));
+        ks_hot.allow_sleep = true;
+        ks_hot.consecutive_sleep_blocks = 0;
+    }
+    else if(verdict == KS_POLICY_BLOCK) {
+        DEBUG_PRINT("Policy disallowed sleep\n");
+        KS_TRACE(KS_TRACE_DECISION, KS_DECISION(false, KS_REASON_POLICY));
+        ks_hot.allow_sleep = false;
+        KS_OVERLAY_SHOW();
+        KS_LED_BLINK();
+    }
+    return verdict != KS_POLICY_DEFAULT;
+}
+#endif
+
+// Is the battery nearly empty, going by the battery bits of a power callback's flags
+static inline bool battery_critical(int pwrflags)
+{
+    return (pwrflags & PSP_POWER_CB_BATTERY_EXIST) && !(pwrflags & PSP_POWER_CB_AC_POWER)
+        && ((pwrflags & PSP_POWER_CB_BATTERY_LOW) || (pwrflags & PSP_POWER_CB_BATTPOWER) <= LOW_BATTERY_PERCENT);
+}
+
+// Check if the user is pressing the override key combination, and decide on the power switch press.
+// Called by the power callback, or by the sysevent handler in the threadless variant.
+KS_HOT void decide_switch_press(void)
+{
+    SceCtrlData pad_state;
+    int pad_ret = sceCtrlPeekBufferPositive(&pad_state, 1);
+    KS_TRACE(KS_TRACE_PAD_SAMPLE, (pad_ret >= 0) ? (int)pad_state.Buttons : pad_ret);
+#if defined(KILLSWITCH_POLICY)
+    if(policy_decide(pad_ret, (pad_ret >= 0) ? pad_state.Buttons : 0)) {
+        return;
+    }
+#endif
+    if(KS_LIKELY(pad_ret >= 0)) {
+        if((pad_state.Buttons & BUTTON_COMBO_MASK) == BUTTON_COMBO_MASK) {
+            DEBUG_PRINT("Override key pressed, allowing sleep\n");
+            KS_STAT_INC(KS_STATS_CORE, overrides);
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_COMBO_HELD));
+            ks_hot.allow_sleep = true;
+            ks_hot.consecutive_sleep_blocks = 0;
+        }
+        else if(IDLE_ALLOW_MS > 0 && sceKernelGetSystemTimeLow() - ks_hot.last_input_time >= IDLE_ALLOW_US) {
+            // Nobody has touched the controls for a while, so the press is almost certainly meant
+            DEBUG_PRINT("No input for " xstr(IDLE_ALLOW_MS) "ms, allowing sleep\n");
+            KS_STAT_INC(KS_STATS_CORE, idle_allows);
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_IDLE));
+            ks_hot.allow_sleep = true;
+            ks_hot.consecutive_sleep_blocks = 0;
+        }
+        else {
+            DEBUG_PRINT("Disallowing sleep\n");
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(false, KS_REASON_NO_COMBO));
+            ks_hot.allow_sleep = false;
+            KS_OVERLAY_SHOW();
+            KS_LED_BLINK();
+        }
+    }
+    else {
+        // There was an error reading button state. Allow sleep in this case.
+        DEBUG_PRINT("Failed to read button state! Allowing sleep\n");
+        KS_STAT_INC(KS_STATS_CORE, pad_read_failures);
+        KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_PAD_ERROR));
+        ks_hot.allow_sleep = true;
+        ks_hot.consecutive_sleep_blocks = 0;
+    }
+}
+
+KS_HOT int killswitchSysEventHandler(int ev_id, char *ev_name, void *param, int *result)
 {
     //DEBUG_PRINT("Got SysEvent 0x%08x - %s\n", ev_id, ev_name);
+    KS_TRACE(KS_TRACE_SYSEVENT_BEGIN, ev_id);
+
+    // Time from the power switch being pressed until the power service asks whether it can sleep
+    if(KS_STAT_ENABLED(KS_STATS_LATENCY) && ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && ks_hot.switch_press_pending) {
+        ks_hot.switch_press_pending = false;
+        KS_STAT_HIST(KS_STATS_LATENCY, query_latency_ms, (sceKernelGetSystemTimeLow() - ks_hot.switch_press_time) / 1000);
+    }
+
+#if KS_CONFIG_THREADLESS
+    // Threadless variant: there's no power callback, so judge the press from the pad as the query comes in.
+    // Blocked queries are retried in quick succession, the failsafe counts those. After a gap it's a new request.
+    // External requests can't be told apart from the switch here, they get through once the failsafe trips.
+    if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY) {
+        unsigned int query_time = sceKernelGetSystemTimeLow();
+        if(query_time - ks_hot.last_query_time >= QUERY_RETRY_GAP_US) {
+            KS_STAT_INC(KS_STATS_CORE, switch_presses);
+            ks_hot.consecutive_sleep_blocks = 0;
+        }
+        ks_hot.last_query_time = query_time;
+
+        decide_switch_press();
+    }
+#else
+    // Every suspend follows a power callback, for the power switch or for an external request.
+    // If none was handled since the last query, the callback thread was starved and the decision is on stale state.
+    if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY) {
+        if(ks_hot.callback_seq == ks_hot.query_seq && !ks_hot.query_retry && ks_hot.consecutive_sleep_blocks == 0) {
+            KS_STAT_INC(KS_STATS_CORE, missed_callbacks);
+        }
+        ks_hot.query_seq = ks_hot.callback_seq;
+    }
+#endif
+
+    // Never risk an unclean power loss, with the battery nearly empty sleep is always allowed
+    if(KS_UNLIKELY(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && ks_hot.battery_critical)) {
+        if(!ks_hot.allow_sleep) {
+            DEBUG_PRINT("Battery low, allowing sleep.\n");
+            KS_STAT_INC(KS_STATS_CORE, low_battery_bypasses);
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_LOW_BATTERY));
+            ks_hot.allow_sleep = true;
+            ks_hot.consecutive_sleep_blocks = 0;
+        }
+
+        KS_STAT_INC(KS_STATS_CORE, allows);
+        KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_OK);
+        return SCE_ERROR_OK;
+    }
+
+    // Polling fallback: the poller may not have seen this request yet. Refuse the first query and have it poll now.
+    // Retries are refused too until it has read the state, so none gets through on the state from before the press.
+    // It keeps polling fast for a while, so the retry or a second press is decided on the current state.
+    if(KS_UNLIKELY(!KS_CONFIG_THREADLESS && ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && ks_hot.power_polling
+        && !(ks_hot.last_pwrflags & PSP_POWER_CB_POWER_SWITCH)
+        && (ks_hot.consecutive_sleep_blocks == 0 || poll_sample_pending)
+        && ks_hot.consecutive_sleep_blocks < MAX_CONSECUTIVE_SLEEPS)) {
+        if(ks_hot.consecutive_sleep_blocks == 0) {
+            DEBUG_PRINT("Suspend query before the poller saw it, blocking and polling\n");
+            poll_query_pending = true;
+            poll_query_time = sceKernelGetSystemTimeLow();
+            poll_sample_pending = true;
+            sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_POLL);
+        }
+        ks_hot.consecutive_sleep_blocks++;
+        KS_STAT_INC(KS_STATS_CORE, blocks);
+        KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_BUSY);
+        return SCE_ERROR_BUSY;
+    }
 
     // Trap SCE_SYSTEM_SUSPEND_EVENT_QUERY
     // Basically the ScePowerMain thread is asking us "is it okay to sleep?"
     if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY) {
-        if(!allow_sleep) {
+        if(!ks_hot.allow_sleep) {
             // There are edgecases where we can still get stuck in an infinite sleep request loop,
             // eg if the user triggers a standby while holding the power switch up.
             // Limit the maximum number of attempts that can be made during a single sleep disallow duration before
             // the request is allowed through as a failsafe.
-            if(consecutive_sleep_blocks < MAX_CONSECUTIVE_SLEEPS) {
-                consecutive_sleep_blocks++;
-                DEBUG_PRINT("Blocked suspend query 0x%08x - %s (%i)\n", ev_id, ev_name, consecutive_sleep_blocks);
+            if(KS_LIKELY(ks_hot.consecutive_sleep_blocks < MAX_CONSECUTIVE_SLEEPS)) {
+                ks_hot.consecutive_sleep_blocks++;
+                KS_STAT_INC(KS_STATS_CORE, blocks);
+                DEBUG_PRINT("Blocked suspend query 0x%08x - %s (%i)\n", ev_id, ev_name, ks_hot.consecutive_sleep_blocks);
+                KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_BUSY);
                 return SCE_ERROR_BUSY;
             }
             else {
-                DEBUG_PRINT("Max consecutive suspend queries reached (%i), allowing sleep.\n", consecutive_sleep_blocks);
+                DEBUG_PRINT("Max consecutive suspend queries reached (%i), allowing sleep.\n", ks_hot.consecutive_sleep_blocks);
+
+                KS_STAT_INC(KS_STATS_CORE, failsafe_trips);
+                KS_STAT_INC(KS_STATS_CORE, allows);
 
                 // We won't receive the power switch released callback since we'll be asleep, so reset allow_sleep here.
-                allow_sleep = true;
+                ks_hot.allow_sleep = true;
+                KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_FAILSAFE));
+                KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_OK);
                 return SCE_ERROR_OK;
             }
         }
+
+        KS_STAT_INC(KS_STATS_CORE, allows);
     }
     else if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_CANCELLATION) {
         DEBUG_PRINT("Got suspend cancelled event 0x%08x - %s\n", ev_id, ev_name);
+        KS_STAT_INC(KS_STATS_VERBOSE, suspend_cancellations);
+        ks_hot.suspend_in_progress = false;
+        ks_hot.query_retry = true;
 
     }
     else if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_START) {
         DEBUG_PRINT("Got suspend start event 0x%08x - %s\n", ev_id, ev_name);
+        KS_STAT_INC(KS_STATS_VERBOSE, suspend_starts);
+        // Just note it, the lifetime stats are saved and the state re-based once we've resumed
+        ks_hot.suspend_in_progress = true;
+    }
+    else if(!KS_CONFIG_THREADLESS && ev_id == SCE_SYSTEM_RESUME_EVENT_COMPLETED && ks_hot.power_polling) {
+        // Without a power callback this is how the poller finds out we've resumed
+        sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_RESUMED);
     }
 
+    KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_OK);
     return SCE_ERROR_OK;
 }
 
+#if !KS_CONFIG_THREADLESS
+
+// Bring the state up to date, the first time we're called after resuming
+KS_COLD void resume_from_suspend(void)
+{
+    DEBUG_PRINT("Resumed\n");
+    ks_hot.suspend_in_progress = false;
+
+    // The resume callback isn't a request to suspend, start the sequence again from here
+    ks_hot.query_seq = ks_hot.callback_seq;
+    ks_hot.query_retry = false;
+
+    // A switch press from before the suspend would count the whole sleep as query latency
+    ks_hot.switch_press_pending = false;
+    ks_hot.consecutive_sleep_blocks = 0;
+
+    // Waking the unit up counts as input
+    ks_hot.last_input_time = sceKernelGetSystemTimeLow();
+
+    // Suspends are a clean point to save the lifetime stats, but not on the way in
+    sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_PERSIST);
+}
+
 // Power Callback handler
-int power_callback_handler(int unknown, int pwrflags, void *common)
+KS_HOT int power_callback_handler(int unknown, int pwrflags, void *common)
 {
+    unsigned int callback_start = KS_STAT_ENABLED(KS_STATS_LATENCY) ? sceKernelGetSystemTimeLow() : 0;
+    KS_STAT_INC(KS_STATS_CORE, callbacks);
+    KS_TRACE(KS_TRACE_CALLBACK_BEGIN, pwrflags);
+
+    // We're only called when the flags change. Getting the same flags again means they changed and changed back
+    // before this thread got to run, eg a switch press and release or a hold toggle were collapsed into one callback.
+    if(pwrflags == ks_hot.last_pwrflags) {
+        DEBUG_PRINT("Power callback without changes (0x%08x), events were collapsed\n", pwrflags);
+        KS_STAT_INC(KS_STATS_CORE, collapsed_callbacks);
+    }
+    ks_hot.last_pwrflags = pwrflags;
+
+    // The battery charge comes with every callback, keep it for the suspend query
+    ks_hot.battery_critical = battery_critical(pwrflags);
+
+    if((pwrflags & PSP_POWER_CB_RESUME_COMPLETE) && ks_hot.suspend_in_progress) {
+        resume_from_suspend();
+    }
+    else {
+        ks_hot.callback_seq++;
+        ks_hot.query_retry = false;
+    }
+
     if (pwrflags & PSP_POWER_CB_POWER_SWITCH) {
         // This is called immediately as the switch is pressed.
         // The SysEventHandler is called when the power switch is released, or held down for a second.
         // This gives us a chance to get in before it and decide whether to allow the sleep.
+        KS_STAT_INC(KS_STATS_CORE, switch_presses);
+        if(KS_STAT_ENABLED(KS_STATS_LATENCY)) {
+            ks_hot.switch_press_time = callback_start;
+            ks_hot.switch_press_pending = true;
+        }
 
         DEBUG_PRINT("Power switch pressed\n");
-
-        // Check if the user is pressing the override key combination
-        //
-        SceCtrlData pad_state;
-        if(sceCtrlPeekBufferPositive(&pad_state, 1) >= 0) {
-            if((pad_state.Buttons & BUTTON_COMBO_MASK) == BUTTON_COMBO_MASK) {
-                DEBUG_PRINT("Override key pressed, allowing sleep\n");
-                allow_sleep = true;
-                consecutive_sleep_blocks = 0;
-            }
-            else {
-                DEBUG_PRINT("Disallowing sleep\n");
-                allow_sleep = false;
-            }
-        }
-        else {
-            // There was an error reading button state. Allow sleep in this case.
-            DEBUG_PRINT("Failed to read button state! Allowing sleep\n");
-            allow_sleep = true;
-            consecutive_sleep_blocks = 0;
-        }
+        decide_switch_press();
     }
     else {
         // If the physical power switch isn't currently pressed, this means any suspend or standby command
@@ -170,16 +472,91 @@ int power_callback_handler(int unknown, int pwrflags, void *common)
         // until we eventually return SCE_ERROR_OK, or we spin until the system watchdog takes us down.
         // Specifically, it appears that anything that calls scePowerRequestStandby() will re-fire the event forever.
         //
-        if(!allow_sleep) {
+        if(!ks_hot.allow_sleep) {
             DEBUG_PRINT("Allowing sleep\n");
-            allow_sleep = true;
-            consecutive_sleep_blocks = 0;
+            ks_hot.allow_sleep = true;
+            ks_hot.consecutive_sleep_blocks = 0;
+            KS_STAT_INC(KS_STATS_VERBOSE, external_requests);
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_EXTERNAL));
         }
     }
 
+    KS_STAT_HIST(KS_STATS_LATENCY, callback_duration_us, sceKernelGetSystemTimeLow() - callback_start);
+    KS_TRACE(KS_TRACE_CALLBACK_END, 0);
+
+    // Write out the log while we're on the callback thread, but don't touch the Memory Stick on the way into suspend
+    if(!(pwrflags & (PSP_POWER_CB_SUSPENDING | PSP_POWER_CB_STANDBY))) {
+        DEBUG_FLUSH();
+    }
+
     return 0;
 }
 
+#endif // !KS_CONFIG_THREADLESS
+
+// The handler microbenchmark (bench/) links only the handlers above, everything below needs kernel mode.
+#ifndef KILLSWITCH_BENCH
+
+#if !KS_CONFIG_THREADLESS
+
+// Save the lifetime stats if they changed, from the callback thread only
+KS_COLD void save_lifetime_stats(void)
+{
+    int save_ret = ks_persist_save();
+    if(save_ret < 0) {
+        DEBUG_PRINT("Failed to save lifetime stats: ret 0x%08x\n", save_ret);
+    }
+    else if(save_ret > 0) {
+        DEBUG_PRINT("Saved lifetime stats\n");
+    }
+}
+
+// Is a decision waiting on the power state, so the poller should run fast
+bool poll_window_open(void)
+{
+    if(poll_query_pending && sceKernelGetSystemTimeLow() - poll_query_time >= POLL_QUERY_WINDOW_US) {
+        poll_query_pending = false;
+    }
+
+    return poll_query_pending || !ks_hot.allow_sleep;
+}
+
+// Polling fallback: call power_callback_handler like the power service would have, when the state changes
+void poll_power_state(int extra_pwrflags)
+{
+    // Cleared before reading, a query blocked after this waits for the next poll
+    poll_sample_pending = false;
+    int pwrflags = ks_poll_pwrflags() | extra_pwrflags;
+    if(pwrflags != ks_hot.last_pwrflags || extra_pwrflags != 0) {
+        power_callback_handler(0, pwrflags, NULL);
+    }
+
+    ks_poll_set_interval(poll_window_open() ? POLL_FAST_US : POLL_IDLE_US);
+}
+
+// Idle policy: note the time if the pad changed since the last sample.
+// A button tapped between samples still bumps the latch make count. Games reading the latch reset it,
+// which looks like input too, that only makes the policy more cautious.
+void sample_input(void)
+{
+    SceCtrlData pad_state;
+    SceCtrlLatch latch;
+
+    if(sceCtrlPeekBufferPositive(&pad_state, 1) < 0 || sceCtrlPeekLatch(&latch) < 0) {
+        return;
+    }
+
+    int dx = (int)pad_state.Lx - (int)last_input_pad.Lx;
+    int dy = (int)pad_state.Ly - (int)last_input_pad.Ly;
+    if(pad_state.Buttons != last_input_pad.Buttons || latch.uiMake != last_input_makes
+        || dx > IDLE_ANALOG_DEADZONE || dx < -IDLE_ANALOG_DEADZONE
+        || dy > IDLE_ANALOG_DEADZONE || dy < -IDLE_ANALOG_DEADZONE) {
+        ks_hot.last_input_time = sceKernelGetSystemTimeLow();
+        last_input_pad = pad_state;
+        last_input_makes = latch.uiMake;
+    }
+}
+
 // Set up and process callbacks
 int callback_thread(SceSize args, void *argp)
 {
@@ -206,22 +583,100 @@ int callback_thread(SceSize args, void *argp)
         }
     }
 
-    if(reg_callback_ret >= 0 && slot >= 0) {
+    bool registered = (reg_callback_ret >= 0 && slot >= 0);
+    bool sampling = false;
+    if(registered) {
         DEBUG_PRINT("Power callback successfully registered in slot %i\n", slot);
-        DEBUG_PRINT("Now processing callbacks\n");
 
-        // Sleep and processing callbacks until we get woken up
-        sceKernelSleepThreadCB();
+        // The idle policy needs the pad sampled now and then. The polling fallback samples it on every poll instead.
+        if(IDLE_ALLOW_MS > 0) {
+            int sample_ret = ks_poll_start(ks_hot.callback_evid, CALLBACK_EVENT_SAMPLE, IDLE_SAMPLE_US);
+            if(sample_ret >= 0) {
+                sampling = true;
+            }
+            else {
+                DEBUG_PRINT("Failed to start pad sampling: ret 0x%08x\n", sample_ret);
+            }
+        }
+    }
+    else {
+        // Keep the plugin working without a callback, at a slight cost
+        DEBUG_PRINT("Failed to register power callback in any slot! Falling back to polling\n");
+        int poll_ret = ks_poll_start(ks_hot.callback_evid, CALLBACK_EVENT_POLL, POLL_IDLE_US);
+        if(poll_ret >= 0) {
+            ks_hot.power_polling = true;
+        }
+        else {
+            DEBUG_PRINT("Failed to start polling: ret 0x%08x\n", poll_ret);
+        }
+    }
+
+    DEBUG_PRINT("Now processing callbacks\n");
+
+    ks_persist_init(MODULE_NAME);
+
+    DEBUG_FLUSH();
+
+    // Process callbacks until module_stop, saving the lifetime stats when asked to and on the interval
+    unsigned int persist_time = sceKernelGetSystemTimeLow();
+    ks_hot.last_input_time = persist_time;
+    for(;;) {
+        unsigned int event_bits = 0;
+        SceUInt timeout = PERSIST_INTERVAL_US;
+        int wait_ret = sceKernelWaitEventFlagCB(ks_hot.callback_evid,
+            CALLBACK_EVENT_STOP | CALLBACK_EVENT_PERSIST | CALLBACK_EVENT_POLL | CALLBACK_EVENT_RESUMED
+            | CALLBACK_EVENT_SAMPLE | CALLBACK_EVENT_LED,
+            PSP_EVENT_WAITOR | PSP_EVENT_WAITCLEAR, &event_bits, &timeout);
+        if(wait_ret < 0 && wait_ret != SCE_KERNEL_ERROR_WAIT_TIMEOUT) {
+            DEBUG_PRINT("Failed to wait for callback thread events: ret 0x%08x\n", wait_ret);
+            break;
+        }
+        if(event_bits & CALLBACK_EVENT_STOP) {
+            break;
+        }
+
+        // Leave the pad alone while suspending, the resume event picks up from here
+        if(event_bits & CALLBACK_EVENT_RESUMED) {
+            poll_power_state(PSP_POWER_CB_RESUME_COMPLETE);
+        }
+        else if((event_bits & CALLBACK_EVENT_POLL) && !ks_hot.suspend_in_progress) {
+            poll_power_state(0);
+        }
+
+        if(IDLE_ALLOW_MS > 0 && (event_bits & (CALLBACK_EVENT_POLL | CALLBACK_EVENT_SAMPLE)) && !ks_hot.suspend_in_progress) {
+            sample_input();
+        }
+
+        if(event_bits & CALLBACK_EVENT_LED) {
+            KS_LED_STEP();
+        }
+
+        // The interval can run out between the suspend starting and the Memory Stick going down
+        if(!ks_hot.suspend_in_progress
+            && ((event_bits & CALLBACK_EVENT_PERSIST) || sceKernelGetSystemTimeLow() - persist_time >= PERSIST_INTERVAL_US)) {
+            persist_time = sceKernelGetSystemTimeLow();
+            save_lifetime_stats();
+            DEBUG_FLUSH();
+        }
+    }
+
+    save_lifetime_stats();
 
-        // Cleanup
+    // Cleanup
+    KS_LED_EXIT();
+    if(registered) {
         reg_callback_ret = scePowerUnregisterCallback(slot);
         if(reg_callback_ret < 0) {
             // We can't really do anything about an error here except log it, although we don't expect this to error
             DEBUG_PRINT("Failed to unregister power callback from slot %i: ret 0x%08x\n", slot, reg_callback_ret);
         }
     }
-    else {
-        DEBUG_PRINT("Failed to register power callback in any slot!\n");
+    if(ks_hot.power_polling || sampling) {
+        int poll_ret = ks_poll_stop();
+        if(poll_ret < 0) {
+            DEBUG_PRINT("Failed to stop polling: ret 0x%08x\n", poll_ret);
+        }
+        ks_hot.power_polling = false;
     }
 
     // Cleanup
@@ -235,7 +690,44 @@ int callback_thread(SceSize args, void *argp)
     return 0;
 }
 
-int register_suspend_handler(void)
+#endif // !KS_CONFIG_THREADLESS
+
+// Called by the stats device before each read
+void ks_statdev_update_state(void)
+{
+    ks_record.state = (ks_hot.allow_sleep ? KS_STATE_ALLOW_SLEEP : 0) | (ks_hot.power_polling ? KS_STATE_POLLING : 0);
+    ks_record.consecutive_sleep_blocks = ks_hot.consecutive_sleep_blocks;
+}
+
+// User mode export, see killswitch_api.h
+int killswitchGetStats(KsStatsRecord *record, int size)
+{
+    return ks_stats_copy_to_user(record, size);
+}
+
+KS_COLD int register_stats_device(void)
+{
+    DEBUG_PRINT("Registering stats device " STATS_DEVICE_NAME "0:\n");
+    int register_ret = ks_statdev_register(STATS_DEVICE_NAME, MODULE_NAME);
+    if(register_ret < 0) {
+        DEBUG_PRINT("Failed to register stats device: ret 0x%08x\n", register_ret);
+    }
+
+    return register_ret;
+}
+
+KS_COLD int unregister_stats_device(void)
+{
+    DEBUG_PRINT("Unregistering stats device\n");
+    int unregister_ret = ks_statdev_unregister();
+    if(unregister_ret < 0) {
+        DEBUG_PRINT("Failed to unregister stats device: ret 0x%08x\n", unregister_ret);
+    }
+
+    return unregister_ret;
+}
+
+KS_COLD int register_suspend_handler(void)
 {
     DEBUG_PRINT("Registering sysevent handler\n");
     int register_sysevent_ret = sceKernelRegisterSysEventHandler(&sys_event);
@@ -246,7 +738,7 @@ int register_suspend_handler(void)
     return register_sysevent_ret;
 }
 
-int unregister_suspend_handler(void)
+KS_COLD int unregister_suspend_handler(void)
 {
     DEBUG_PRINT("Unregistering sysevent handler\n");
     int unregister_sysevent_ret = sceKernelUnregisterSysEventHandler(&sys_event);
@@ -257,10 +749,22 @@ int unregister_suspend_handler(void)
     return unregister_sysevent_ret;
 }
 
+#if !KS_CONFIG_THREADLESS
+
 // Starts callback thread
-int start_callbacks(void)
+KS_COLD int start_callbacks(void)
 {
     int result;
+
+    // Wakes the callback thread to save the lifetime stats or to exit
+    result = sceKernelCreateEventFlag(MODULE_NAME "Events", 0, 0, NULL);
+    if(result < 0) {
+        DEBUG_PRINT("Failed to create callback event flag: ret 0x%08x\n", result);
+        return result;
+    }
+    ks_hot.callback_evid = result;
+    KS_LED_INIT(ks_hot.callback_evid, CALLBACK_EVENT_LED);
+
     // name, entry, initPriority, stackSize, PspThreadAttributes, SceKernelThreadOptParam
     result = sceKernelCreateThread(MODULE_NAME "TaskCallbacks", callback_thread, 0x11, 0x800, 0, 0);
     if (result >= 0) {
@@ -278,15 +782,15 @@ int start_callbacks(void)
     return result;
 }
 
-int stop_callbacks(void)
+KS_COLD int stop_callbacks(void)
 {
     int result = 0;
     int thid = callback_thid;
     if(thid >= 0) {
-        // Unblock sceKernelSleepThreadCB() and have thread begin cleanup
-        result = sceKernelWakeupThread(thid);
+        // Unblock sceKernelWaitEventFlagCB() and have thread begin cleanup
+        result = sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_STOP);
         if(result < 0) {
-            DEBUG_PRINT("Failed to wakeup callback thread: ret 0x%08x\n", result);
+            DEBUG_PRINT("Failed to signal callback thread: ret 0x%08x\n", result);
         }
 
         // Wait for the callback thread to clean up and exit
@@ -318,53 +822,109 @@ int stop_callbacks(void)
         }
     }
 
+    // The event flag can go once nothing can wait on it
+    if(callback_thid < 0 && ks_hot.callback_evid >= 0) {
+        int delete_ret = sceKernelDeleteEventFlag(ks_hot.callback_evid);
+        if(delete_ret >= 0) {
+            ks_hot.callback_evid = -1;
+        }
+        else {
+            DEBUG_PRINT("Failed to delete callback event flag: ret 0x%08x\n", delete_ret);
+        }
+    }
+
     return result;
 }
 
+#else
+
+SceUID battery_alarm_id = -1;
+
+// Threadless variant: keep the battery bits of last_pwrflags and battery_critical up to date, as the power callback
+// does for the other variants, so the suspend query doesn't call into the power service. Runs as an alarm.
+KS_COLD SceUInt refresh_battery_state(void *common)
+{
+    int pwrflags = ks_poll_battery_pwrflags();
+    ks_hot.last_pwrflags = pwrflags;
+    ks_hot.battery_critical = battery_critical(pwrflags);
+    return BATTERY_REFRESH_US;
+}
+
+#endif // !KS_CONFIG_THREADLESS
+
 // Called during module init
-int module_start(SceSize args, void *argp)
+KS_COLD int module_start(SceSize args, void *argp)
 {
     int result;
 
-    #ifdef DEBUG
-    pspDebugScreenInit();
-    #endif
+    DEBUG_INIT();
+    KS_FAULT_LOAD(MODULE_NAME);
+    KS_POLICY_LOAD(MODULE_NAME);
 
     DEBUG_PRINT(MODULE_NAME " v" xstr(MAJOR_VER) "." xstr(MINOR_VER) " Module Start\n");
 
+#if !KS_CONFIG_THREADLESS
     result = start_callbacks();
     if(result < 0) {
         return MODULE_ERROR;
     }
+#else
+    // Without it the low battery bypass never trips, the failsafe still lets a suspend through
+    refresh_battery_state(NULL);
+    battery_alarm_id = sceKernelSetAlarm(BATTERY_REFRESH_US, refresh_battery_state, NULL);
+    if(battery_alarm_id < 0) {
+        DEBUG_PRINT("Failed to start battery refresh: ret 0x%08x\n", battery_alarm_id);
+    }
+#endif
 
     result = register_suspend_handler();
     if(result < 0) {
         return MODULE_ERROR;
     }
 
+    // The stats device is only for monitoring, carry on without it if it can't be registered
+    register_stats_device();
+
+    // Same for the overlay
+    KS_OVERLAY_INIT();
+
     DEBUG_PRINT("Started.\n");
 
     return MODULE_OK;
 }
 
 // Called during module deinit
-int module_stop(SceSize args, void *argp)
+KS_COLD int module_stop(SceSize args, void *argp)
 {
     int result;
 
     DEBUG_PRINT("Stopping ...\n");
 
+    unregister_stats_device();
+    KS_OVERLAY_EXIT();
+
     result = unregister_suspend_handler();
     if(result < 0) {
         return MODULE_ERROR;
     }
 
+#if !KS_CONFIG_THREADLESS
     result = stop_callbacks();
     if(result < 0) {
         return MODULE_ERROR;
     }
+#else
+    if(battery_alarm_id >= 0) {
+        sceKernelCancelAlarm(battery_alarm_id);
+        battery_alarm_id = -1;
+    }
+#endif
 
     DEBUG_PRINT(MODULE_NAME " v" xstr(MAJOR_VER) "." xstr(MINOR_VER) " Module Stop\n");
+    // The callback thread has exited, so it's safe to flush from here
+    DEBUG_FLUSH();
 
     return MODULE_OK;
 }
+
+#endif // KILLSWITCH_BENCH
@@ -0,0 +1,27 @@
+// PSP-KillSwitch user mode API
+//
+// Lets user mode homebrew query the plugins with one syscall per plugin.
+// Link against the stubs generated from the plugin exports with "psp-build-exports -s exports.exp exports_hold.exp",
+// see monitor/ for an example. If a plugin isn't loaded its function returns a negative error.
+//
+// Ryan Crosby 2025
+
+#ifndef KILLSWITCH_API_H
+#define KILLSWITCH_API_H
+
+#include "ks_stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Copy up to size bytes of the plugin's KsStatsRecord into record.
+// Returns the number of bytes copied, or < 0 on error.
+int killswitchGetStats(KsStatsRecord *record, int size);
+int killswitchHoldGetStats(KsStatsRecord *record, int size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // KILLSWITCH_API_H
@@ -4,11 +4,6 @@
 //
 // Ryan Crosby 2025
 
-#ifdef DEBUG
-#include <pspdebug.h>
-#include <pspdisplay.h>
-#endif
-
 #include <pspsdk.h>
 #include <psputils.h>
 #include <psppower.h>
@@ -18,23 +13,64 @@
 
 #include <stdbool.h>
 
+#include "ks_config.h"
+#include "ks_layout.h"
+#include "ks_log.h"
+#include "ks_stats.h"
+#include "ks_statdev.h"
+#include "ks_persist.h"
+#include "ks_poll.h"
+#include "ks_overlay.h"
+#include "ks_led.h"
+#include "ks_fault.h"
+#include "ks_policy.h"
+
 #define str(s) #s // For stringizing defines
 #define xstr(s) str(s)
 
-#ifdef DEBUG
-#define DEBUG_PRINT(...) pspDebugScreenKprintf( __VA_ARGS__ )
-#else
-#define DEBUG_PRINT(...) do{ } while ( 0 )
-#endif
-
 #define ONE_MSEC (1000)
 
-// Disable sleep for 0.5 seconds after hold is deactivated
-#define DISABLE_DURATION_MS 500
+// Policy settings come from the generated ks_config.h, see ks_config.h.in and the KILLSWITCH_* CMake cache variables
+
+// Disable sleep for 0.5 seconds after hold is deactivated by default
+#define DISABLE_DURATION_MS KS_CONFIG_DISABLE_DURATION_MS
 #define DISABLE_DURATION (DISABLE_DURATION_MS * ONE_MSEC)
-#define MAX_CONSECUTIVE_SLEEPS 10
 
-#define MODULE_NAME "KillSwitchHold"
+// Hold switch debounce. A release this soon after hold was switched on is contact bounce.
+#define HOLD_DEBOUNCE_MS KS_CONFIG_HOLD_DEBOUNCE_MS
+#define HOLD_DEBOUNCE (HOLD_DEBOUNCE_MS * ONE_MSEC)
+// Switching hold back on this soon after a release is bounce too. Longer than the debounce, so noise on a
+// half-seated switch keeps the lockout running rather than cancelling or restarting it.
+#define HOLD_REARM_MS KS_CONFIG_HOLD_REARM_MS
+#define HOLD_REARM (HOLD_REARM_MS * ONE_MSEC)
+#define MAX_CONSECUTIVE_SLEEPS KS_CONFIG_MAX_CONSECUTIVE_SLEEPS
+
+// Combined variant: outside the lockout the switch also needs this button combo held, as in KillSwitch
+#define BUTTON_COMBO_MASK KS_CONFIG_BUTTON_COMBO_MASK
+
+// Combined variant: always allow sleep when running on a battery at or below this charge
+#define LOW_BATTERY_PERCENT KS_CONFIG_LOW_BATTERY_PERCENT
+
+#define MODULE_NAME KS_CONFIG_MODULE_NAME
+
+// Stats device, read "ksh0:" to get the KsStatsRecord
+#define STATS_DEVICE_NAME "ksh"
+
+// Lifetime stats are saved to ms0:/SEPLUGINS/<MODULE_NAME>.stats after each resume and at most this often otherwise
+#define PERSIST_INTERVAL_US (10 * 60 * 1000 * 1000)
+
+// Callback thread event flag bits
+#define CALLBACK_EVENT_STOP     0x00000001 // module_stop, clean up and exit
+#define CALLBACK_EVENT_PERSIST  0x00000002 // Save the lifetime stats
+#define CALLBACK_EVENT_POLL     0x00000004 // Polling fallback, poll the power state
+#define CALLBACK_EVENT_RESUMED  0x00000008 // Polling fallback, resumed from a suspend
+#define CALLBACK_EVENT_LED      0x00000020 // Next step of the LED blink
+
+// Polling fallback, used when there's no free power callback slot
+#define POLL_FAST_US (20 * 1000)            // While a decision depends on the power state
+#define POLL_IDLE_US (1000 * 1000)          // Otherwise
+#define POLL_QUERY_WINDOW_US (2000 * 1000)  // Poll fast for this long after a suspend query the poller hadn't seen
+
 #define MAJOR_VER 1
 #define MINOR_VER 3
 
@@ -50,7 +86,10 @@
 #define SCE_SYSTEM_SUSPEND_EVENT_QUERY              0x00000100
 #define SCE_SYSTEM_SUSPEND_EVENT_CANCELLATION       0x00000101
 #define SCE_SYSTEM_SUSPEND_EVENT_START              0x00000102
+#define SCE_RESUME_EVENTS                           0x00FF0000
+#define SCE_SYSTEM_RESUME_EVENT_COMPLETED           0x00400000
 
+#ifndef KILLSWITCH_BENCH
 // We are building a kernel mode prx plugin
 PSP_MODULE_INFO(MODULE_NAME, PSP_MODULE_KERNEL, MAJOR_VER, MINOR_VER);
 
@@ -65,21 +104,56 @@ PSP_NO_CREATE_MAIN_THREAD();
 
 // We don't need any of the newlib features since we're not calling into stdio or stdlib etc
 PSP_DISABLE_NEWLIB();
+#endif
 
 static int killswitchSysEventHandler(int ev_id, char *ev_name, void *param, int *result);
 static int power_callback_handler(int unknown, int pwrflags, void *common);
 
-bool hold_active = false;
-clock_t hold_release_timestamp = 0;
-bool allow_sleep = true;
-int consecutive_sleep_blocks = 0;
+// State used on the switch and suspend path, kept together in one cache line, see ks_layout.h
+typedef struct {
+    int consecutive_sleep_blocks;
+    int callback_evid;
+    unsigned int switch_press_time;
+    clock_t hold_release_timestamp;
+    clock_t hold_edge_timestamp;    // Last accepted hold switch change, 0 if none
+    clock_t hold_bounce_timestamp;  // First change rejected since then, 0 if the switch is back where it was accepted
+    clock_t suspend_timestamp;      // Snapshotted at suspend start, to re-base the timers on resume
+
+    // Power event sequence accounting, to spot callbacks that were collapsed or arrived too late
+    int last_pwrflags;
+    unsigned int callback_seq;      // Power callbacks handled, not counting the first one after a resume
+    unsigned int query_seq;         // callback_seq at the last suspend query
+
+    bool hold_active;
+    bool suspend_hold_active;       // hold_active at suspend start
+    bool allow_sleep;
+    bool suspend_in_progress;
+    bool switch_press_pending;
+    bool battery_critical;          // Combined variant, cached from the power callback flags
+    bool query_retry;               // A suspend was cancelled, queries can repeat without a new callback
+    bool power_polling;             // Polling fallback in use
+} KsHotState;
+_Static_assert(sizeof(KsHotState) <= KS_CACHE_LINE, "KsHotState must fit in one cache line");
+
+KsHotState ks_hot KS_HOT_STATE = {
+    .callback_evid = -1,
+    .allow_sleep = true,
+};
+
 int callback_thid = -1;
 
+KsStatsRecord ks_record;
+
+// Polling fallback state
+bool poll_query_pending = false;
+unsigned int poll_query_time = 0;
+bool poll_sample_pending = false;   // A query was blocked for the poller, and it hasn't read the state since
+
 // Our PspSysEventHandler to receive the power switch event
 PspSysEventHandler sys_event = {
     .size = sizeof(PspSysEventHandler),
     .name = "sce" MODULE_NAME, // Arbitrary string, doesn't appear to be used for anything
-    .type_mask = SCE_SUSPEND_EVENTS,
+    .type_mask = SCE_SUSPEND_EVENTS | SCE_RESUME_EVENTS, // Resume events are only used by the polling fallback
     .handler = killswitchSysEventHandler,
     .r28 = 0,
     .busy = 0,
@@ -97,60 +171,276 @@ PspSysEventHandler sys_event = {
     }
 };
 
-int killswitchSysEventHandler(int ev_id, char *ev_name, void *param, int *result)
+KS_HOT int killswitchSysEventHandler(int ev_id, char *ev_name, void *param, int *result)
 {
     //DEBUG_PRINT("Got SysEvent 0x%08x - %s\n", ev_id, ev_name);
+    KS_TRACE(KS_TRACE_SYSEVENT_BEGIN, ev_id);
+
+    // Time from the power switch being pressed until the power service asks whether it can sleep
+    if(KS_STAT_ENABLED(KS_STATS_LATENCY) && ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && ks_hot.switch_press_pending) {
+        ks_hot.switch_press_pending = false;
+        KS_STAT_HIST(KS_STATS_LATENCY, query_latency_ms, (sceKernelGetSystemTimeLow() - ks_hot.switch_press_time) / 1000);
+    }
+
+    // Every suspend follows a power callback, for the power switch or for an external request.
+    // If none was handled since the last query, the callback thread was starved and the decision is on stale state.
+    if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY) {
+        if(ks_hot.callback_seq == ks_hot.query_seq && !ks_hot.query_retry && ks_hot.consecutive_sleep_blocks == 0) {
+            KS_STAT_INC(KS_STATS_CORE, missed_callbacks);
+        }
+        ks_hot.query_seq = ks_hot.callback_seq;
+    }
+
+    // Combined variant: with the combo blocking every press, never risk an unclean power loss on a nearly empty battery
+    if(KS_UNLIKELY(KS_CONFIG_COMBINED && ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && ks_hot.battery_critical)) {
+        if(!ks_hot.allow_sleep) {
+            DEBUG_PRINT("Battery low, allowing sleep.\n");
+            KS_STAT_INC(KS_STATS_CORE, low_battery_bypasses);
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_LOW_BATTERY));
+            ks_hot.allow_sleep = true;
+            ks_hot.consecutive_sleep_blocks = 0;
+        }
+
+        KS_STAT_INC(KS_STATS_CORE, allows);
+        KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_OK);
+        return SCE_ERROR_OK;
+    }
+
+    // Polling fallback: the poller may not have seen this request yet. Refuse the first query and have it poll now.
+    // Retries are refused too until it has read the state, so none gets through on the state from before the press.
+    // It keeps polling fast for a while, so the retry or a second press is decided on the current state.
+    if(KS_UNLIKELY(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && ks_hot.power_polling
+        && !(ks_hot.last_pwrflags & PSP_POWER_CB_POWER_SWITCH)
+        && (ks_hot.consecutive_sleep_blocks == 0 || poll_sample_pending)
+        && ks_hot.consecutive_sleep_blocks < MAX_CONSECUTIVE_SLEEPS)) {
+        if(ks_hot.consecutive_sleep_blocks == 0) {
+            DEBUG_PRINT("Suspend query before the poller saw it, blocking and polling\n");
+            poll_query_pending = true;
+            poll_query_time = sceKernelGetSystemTimeLow();
+            poll_sample_pending = true;
+            sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_POLL);
+        }
+        ks_hot.consecutive_sleep_blocks++;
+        KS_STAT_INC(KS_STATS_CORE, blocks);
+        KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_BUSY);
+        return SCE_ERROR_BUSY;
+    }
 
     // Trap SCE_SYSTEM_SUSPEND_EVENT_QUERY
     // Basically the ScePowerMain thread is asking us "is it okay to sleep?"
-    if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && !allow_sleep) {
+    if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY && !ks_hot.allow_sleep) {
         // There are edgecases where we can still get stuck in an infinite sleep request loop,
         // eg if the user triggers a standby while holding the power switch up.
         // Limit the maximum number of attempts that can be made during a single sleep disallow duration before
         // the request is allowed through as a failsafe.
-        if(consecutive_sleep_blocks < MAX_CONSECUTIVE_SLEEPS) {
-            consecutive_sleep_blocks++;
-            DEBUG_PRINT("Blocked suspend query 0x%08x - %s (%i)\n", ev_id, ev_name, consecutive_sleep_blocks);
+        if(KS_LIKELY(ks_hot.consecutive_sleep_blocks < MAX_CONSECUTIVE_SLEEPS)) {
+            ks_hot.consecutive_sleep_blocks++;
+            KS_STAT_INC(KS_STATS_CORE, blocks);
+            DEBUG_PRINT("Blocked suspend query 0x%08x - %s (%i)\n", ev_id, ev_name, ks_hot.consecutive_sleep_blocks);
+            KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_BUSY);
             return SCE_ERROR_BUSY;
         }
         else {
-            DEBUG_PRINT("Max consecutive suspend queries reached (%i), allowing sleep.\n", consecutive_sleep_blocks);
+            DEBUG_PRINT("Max consecutive suspend queries reached (%i), allowing sleep.\n", ks_hot.consecutive_sleep_blocks);
+
+            KS_STAT_INC(KS_STATS_CORE, failsafe_trips);
+            KS_STAT_INC(KS_STATS_CORE, allows);
 
             // We won't receive the power switch released callback since we'll be asleep, so reset allow_sleep here.
-            allow_sleep = true;
+            ks_hot.allow_sleep = true;
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_FAILSAFE));
+            KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_OK);
             return SCE_ERROR_OK;
         }
     }
+    else if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_QUERY) {
+        KS_STAT_INC(KS_STATS_CORE, allows);
+    }
     else if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_CANCELLATION) {
         DEBUG_PRINT("Got suspend cancelled event 0x%08x - %s\n", ev_id, ev_name);
+        KS_STAT_INC(KS_STATS_VERBOSE, suspend_cancellations);
+        ks_hot.suspend_in_progress = false;
+        ks_hot.query_retry = true;
 
     }
     else if(ev_id == SCE_SYSTEM_SUSPEND_EVENT_START) {
         DEBUG_PRINT("Got suspend start event 0x%08x - %s\n", ev_id, ev_name);
+        KS_STAT_INC(KS_STATS_VERBOSE, suspend_starts);
+        // Just take a snapshot, the lifetime stats are saved and the timers re-based once we've resumed
+        ks_hot.suspend_in_progress = true;
+        ks_hot.suspend_timestamp = sceKernelLibcClock();
+        ks_hot.suspend_hold_active = ks_hot.hold_active;
+    }
+    else if(ev_id == SCE_SYSTEM_RESUME_EVENT_COMPLETED && ks_hot.power_polling) {
+        // Without a power callback this is how the poller finds out we've resumed
+        sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_RESUMED);
     }
 
+    KS_TRACE(KS_TRACE_SYSEVENT_END, SCE_ERROR_OK);
     return SCE_ERROR_OK;
 }
 
+#if defined(KILLSWITCH_POLICY)
+// Run the policy program on a power switch press, if one was loaded. Returns true if it decided the press.
+static KS_HOT bool policy_decide(int pwrflags, clock_t current_timestamp)
+{
+    if(!ks_policy_active()) {
+        return false;
+    }
+
+    SceCtrlData pad_state;
+    int pad_ret = sceCtrlPeekBufferPositive(&pad_state, 1);
+    KS_TRACE(KS_TRACE_PAD_SAMPLE, (pad_ret >= 0) ? (int)pad_state.Buttons : pad_ret);
+    if(KS_UNLIKELY(pad_ret < 0)) {
+        // Without the pad the program can't be trusted, leave the press to the plugin's own rules
+        DEBUG_PRINT("Failed to read button state! Skipping the policy program.\n");
+        KS_STAT_INC(KS_STATS_CORE, pad_read_failures);
+        return false;
+    }
+
+    unsigned int inputs[KS_POLICY_INPUT_COUNT];
+    inputs[KS_POLICY_IN_BUTTONS] = pad_state.Buttons;
+    inputs[KS_POLICY_IN_PAD_ERROR] = 0;
+    inputs[KS_POLICY_IN_IDLE_MS] = 0;
+    inputs[KS_POLICY_IN_HOLD_RELEASE_MS] = (ks_hot.hold_release_timestamp != 0)
+        ? (unsigned int)(current_timestamp - ks_hot.hold_release_timestamp) / ONE_MSEC : 0xFFFFFFFF;
+    inputs[KS_POLICY_IN_HOLD] = ks_hot.hold_active;
+    inputs[KS_POLICY_IN_BATTERY] = (pwrflags & PSP_POWER_CB_BATTERY_EXIST) ? (pwrflags & PSP_POWER_CB_BATTPOWER) : 0;
+    inputs[KS_POLICY_IN_AC] = (pwrflags & PSP_POWER_CB_AC_POWER) != 0;
+    inputs[KS_POLICY_IN_LOW_BATTERY] = (pwrflags & PSP_POWER_CB_BATTERY_EXIST) && !(pwrflags & PSP_POWER_CB_AC_POWER)
+        && ((pwrflags & PSP_POWER_CB_BATTERY_LOW) || (pwrflags & PSP_POWER_CB_BATTPOWER) <= LOW_BATTERY_PERCENT);
+
+    int verdict = ks_policy_eval(inputs);
+    if(verdict == KS_POLICY_ALLOW) {
+        DEBUG_PRINT("Policy allowed sleep.\n");
+        KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_POLICY));
+        ks_hot.allow_sleep = true;
+        ks_hot.consecutive_sleep_blocks = 0;
+    }
+    else if(verdict == KS_POLICY_BLOCK) {
+        DEBUG_PRINT("Policy disallowed sleep.\n");
+        KS_TRACE(KS_TRACE_DECISION, KS_DECISION(false, KS_REASON_POLICY));
+        ks_hot.allow_sleep = false;
+        KS_OVERLAY_SHOW();
+        KS_LED_BLINK();
+    }
+    return verdict != KS_POLICY_DEFAULT;
+}
+#endif
+
+// Bring the state from the suspend snapshot up to date, the first time we're called after resuming
+KS_COLD void resume_from_suspend(int pwrflags, clock_t current_timestamp)
+{
+    DEBUG_PRINT("Resumed after %ims\n", (current_timestamp - ks_hot.suspend_timestamp) / 1000);
+    ks_hot.suspend_in_progress = false;
+
+    // The clock may have jumped while we were asleep. The lockout only counts time awake,
+    // so keep the hold release the same distance behind the clock as it was at suspend.
+    if(ks_hot.hold_release_timestamp != 0) {
+        ks_hot.hold_release_timestamp = current_timestamp - (ks_hot.suspend_timestamp - ks_hot.hold_release_timestamp);
+    }
+
+    // Nothing before the suspend can be bounce of what comes after it
+    ks_hot.hold_edge_timestamp = 0;
+    ks_hot.hold_bounce_timestamp = 0;
+
+    // Hold released while asleep is long enough ago, don't start a lockout for it
+    if(ks_hot.suspend_hold_active && !(pwrflags & PSP_POWER_CB_HOLD_SWITCH)) {
+        DEBUG_PRINT("Hold deactivated during suspend.\n");
+        KS_STAT_INC(KS_STATS_VERBOSE, hold_edges);
+        ks_hot.hold_active = false;
+        ks_hot.hold_release_timestamp = 0;
+    }
+
+    // The resume callback isn't a request to suspend, start the sequence again from here
+    ks_hot.query_seq = ks_hot.callback_seq;
+    ks_hot.query_retry = false;
+
+    // A switch press from before the suspend would count the whole sleep as query latency
+    ks_hot.switch_press_pending = false;
+    ks_hot.consecutive_sleep_blocks = 0;
+
+    // Suspends are a clean point to save the lifetime stats, but not on the way in
+    sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_PERSIST);
+}
+
 // Power Callback handler
-int power_callback_handler(int unknown, int pwrflags, void *common)
+KS_HOT int power_callback_handler(int unknown, int pwrflags, void *common)
 {
+    unsigned int callback_start = KS_STAT_ENABLED(KS_STATS_LATENCY) ? sceKernelGetSystemTimeLow() : 0;
+    KS_STAT_INC(KS_STATS_CORE, callbacks);
+    KS_TRACE(KS_TRACE_CALLBACK_BEGIN, pwrflags);
+
     clock_t current_timestamp = sceKernelLibcClock();
 
+    // We're only called when the flags change. Getting the same flags again means they changed and changed back
+    // before this thread got to run, eg a switch press and release or a hold toggle were collapsed into one callback.
+    if(pwrflags == ks_hot.last_pwrflags) {
+        DEBUG_PRINT("Power callback without changes (0x%08x), events were collapsed\n", pwrflags);
+        KS_STAT_INC(KS_STATS_CORE, collapsed_callbacks);
+    }
+    ks_hot.last_pwrflags = pwrflags;
+
+#if KS_CONFIG_COMBINED
+    // The battery charge comes with every callback, keep it for the suspend query
+    ks_hot.battery_critical = (pwrflags & PSP_POWER_CB_BATTERY_EXIST) && !(pwrflags & PSP_POWER_CB_AC_POWER)
+        && ((pwrflags & PSP_POWER_CB_BATTERY_LOW) || (pwrflags & PSP_POWER_CB_BATTPOWER) <= LOW_BATTERY_PERCENT);
+#endif
+
+    if((pwrflags & PSP_POWER_CB_RESUME_COMPLETE) && ks_hot.suspend_in_progress) {
+        resume_from_suspend(pwrflags, current_timestamp);
+    }
+    else {
+        ks_hot.callback_seq++;
+        ks_hot.query_retry = false;
+    }
+
+    // Only changes that last past the debounce are taken. A rejected change is picked up by the next callback
+    // if the switch stays there, which is at the latest the power switch press the lockout is for.
+    // It's dated from when it was first seen, not from the callback that took it.
+    clock_t edge_time_ago = current_timestamp - ks_hot.hold_edge_timestamp;
+    clock_t edge_timestamp = (ks_hot.hold_bounce_timestamp != 0) ? ks_hot.hold_bounce_timestamp : current_timestamp;
     if(pwrflags & PSP_POWER_CB_HOLD_SWITCH) {
-        if(!hold_active) {
-            DEBUG_PRINT("Hold activated.\n");
-            hold_active = true;
-            consecutive_sleep_blocks = 0;
-            hold_release_timestamp = 0;
+        if(!ks_hot.hold_active) {
+            if((ks_hot.hold_edge_timestamp != 0) && (edge_time_ago < HOLD_REARM)) {
+                DEBUG_PRINT("Hold bounced on %ims after release, ignoring.\n", (edge_time_ago / 1000));
+                KS_STAT_INC(KS_STATS_CORE, hold_bounces);
+                ks_hot.hold_bounce_timestamp = edge_timestamp;
+            }
+            else {
+                DEBUG_PRINT("Hold activated.\n");
+                KS_STAT_INC(KS_STATS_VERBOSE, hold_edges);
+                ks_hot.hold_active = true;
+                ks_hot.hold_edge_timestamp = edge_timestamp;
+                ks_hot.hold_bounce_timestamp = 0;
+                ks_hot.consecutive_sleep_blocks = 0;
+                ks_hot.hold_release_timestamp = 0;
+            }
+        }
+        else {
+            // Back where it was, whatever was rejected was bounce
+            ks_hot.hold_bounce_timestamp = 0;
         }
     }
     else {
-        if(hold_active) {
-            // User just switched off hold.
-            DEBUG_PRINT("Hold deactivated.\n");
-            hold_active = false;
-            hold_release_timestamp = current_timestamp;
+        if(ks_hot.hold_active) {
+            if((ks_hot.hold_edge_timestamp != 0) && (edge_time_ago < HOLD_DEBOUNCE)) {
+                DEBUG_PRINT("Hold bounced off %ims after activation, ignoring.\n", (edge_time_ago / 1000));
+                KS_STAT_INC(KS_STATS_CORE, hold_bounces);
+                ks_hot.hold_bounce_timestamp = edge_timestamp;
+            }
+            else {
+                // User just switched off hold.
+                DEBUG_PRINT("Hold deactivated.\n");
+                KS_STAT_INC(KS_STATS_VERBOSE, hold_edges);
+                ks_hot.hold_active = false;
+                ks_hot.hold_edge_timestamp = edge_timestamp;
+                ks_hot.hold_bounce_timestamp = 0;
+                ks_hot.hold_release_timestamp = edge_timestamp;
+            }
+        }
+        else {
+            ks_hot.hold_bounce_timestamp = 0;
         }
     }
 
@@ -158,20 +448,67 @@ int power_callback_handler(int unknown, int pwrflags, void *common)
         // This is called immediately as the switch is pressed.
         // The SysEventHandler is called when the power switch is released, or held down for a second.
         // This gives us a chance to get in before it and decide whether to allow the sleep.
+        KS_STAT_INC(KS_STATS_CORE, switch_presses);
+        if(KS_STAT_ENABLED(KS_STATS_LATENCY)) {
+            ks_hot.switch_press_time = callback_start;
+            ks_hot.switch_press_pending = true;
+        }
 
         DEBUG_PRINT("Power switch pressed.\n");
 
         // Check if the hold switch was recently pressed
-        clock_t hold_time_ago = current_timestamp - hold_release_timestamp;
-        if((hold_release_timestamp != 0) && (hold_time_ago < DISABLE_DURATION)) {
+        clock_t hold_time_ago = current_timestamp - ks_hot.hold_release_timestamp;
+#if defined(KILLSWITCH_POLICY)
+        if(policy_decide(pwrflags, current_timestamp)) {
+            // The policy program decided the press
+        }
+        else
+#endif
+        if((ks_hot.hold_release_timestamp != 0) && (hold_time_ago < DISABLE_DURATION)) {
             DEBUG_PRINT("Hold recently pressed (%ims < " xstr(DISABLE_DURATION_MS) "ms), disallowing sleep.\n", (hold_time_ago / 1000));
-            allow_sleep = false;
+            ks_hot.allow_sleep = false;
+            KS_STAT_INC(KS_STATS_CORE, lockout_hits);
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(false, KS_REASON_HOLD_LOCKOUT));
+            KS_OVERLAY_SHOW();
+            KS_LED_BLINK();
         }
+#if KS_CONFIG_COMBINED
+        else {
+            // Outside the lockout the combo decides, as in KillSwitch
+            SceCtrlData pad_state;
+            int pad_ret = sceCtrlPeekBufferPositive(&pad_state, 1);
+            KS_TRACE(KS_TRACE_PAD_SAMPLE, (pad_ret >= 0) ? (int)pad_state.Buttons : pad_ret);
+            if(KS_UNLIKELY(pad_ret < 0)) {
+                // There was an error reading button state. Allow sleep in this case.
+                DEBUG_PRINT("Failed to read button state! Allowing sleep.\n");
+                KS_STAT_INC(KS_STATS_CORE, pad_read_failures);
+                KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_PAD_ERROR));
+                ks_hot.allow_sleep = true;
+                ks_hot.consecutive_sleep_blocks = 0;
+            }
+            else if((pad_state.Buttons & BUTTON_COMBO_MASK) == BUTTON_COMBO_MASK) {
+                DEBUG_PRINT("Override key pressed, allowing sleep.\n");
+                KS_STAT_INC(KS_STATS_CORE, overrides);
+                KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_COMBO_HELD));
+                ks_hot.allow_sleep = true;
+                ks_hot.consecutive_sleep_blocks = 0;
+            }
+            else {
+                DEBUG_PRINT("Override key not pressed, disallowing sleep.\n");
+                KS_TRACE(KS_TRACE_DECISION, KS_DECISION(false, KS_REASON_NO_COMBO));
+                ks_hot.allow_sleep = false;
+                KS_OVERLAY_SHOW();
+                KS_LED_BLINK();
+            }
+        }
+#else
         else {
             DEBUG_PRINT("Hold not recently pressed, allowing sleep.\n");
-            allow_sleep = true;
-            consecutive_sleep_blocks = 0;
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_NO_LOCKOUT));
+            ks_hot.allow_sleep = true;
+            ks_hot.consecutive_sleep_blocks = 0;
         }
+#endif
     }
     else {
         // If the physical power switch isn't currently pressed, this means any suspend or standby command
@@ -183,16 +520,68 @@ int power_callback_handler(int unknown, int pwrflags, void *common)
         // until we eventually return SCE_ERROR_OK, or we spin until the system watchdog takes us down.
         // Specifically, it appears that anything that calls scePowerRequestStandby() will re-fire the event forever.
         //
-        if(!allow_sleep) {
+        if(!ks_hot.allow_sleep) {
             DEBUG_PRINT("Power switch released, allowing sleep.\n");
-            allow_sleep = true;
-            consecutive_sleep_blocks = 0;
+            ks_hot.allow_sleep = true;
+            ks_hot.consecutive_sleep_blocks = 0;
+            KS_STAT_INC(KS_STATS_VERBOSE, external_requests);
+            KS_TRACE(KS_TRACE_DECISION, KS_DECISION(true, KS_REASON_EXTERNAL));
         }
     }
 
+    KS_STAT_HIST(KS_STATS_LATENCY, callback_duration_us, sceKernelGetSystemTimeLow() - callback_start);
+    KS_TRACE(KS_TRACE_CALLBACK_END, 0);
+
+    // Write out the log while we're on the callback thread, but don't touch the Memory Stick on the way into suspend
+    if(!(pwrflags & (PSP_POWER_CB_SUSPENDING | PSP_POWER_CB_STANDBY))) {
+        DEBUG_FLUSH();
+    }
+
     return 0;
 }
 
+// The handler microbenchmark (bench/) links only the handlers above, everything below needs kernel mode.
+#ifndef KILLSWITCH_BENCH
+
+// Save the lifetime stats if they changed, from the callback thread only
+KS_COLD void save_lifetime_stats(void)
+{
+    int save_ret = ks_persist_save();
+    if(save_ret < 0) {
+        DEBUG_PRINT("Failed to save lifetime stats: ret 0x%08x\n", save_ret);
+    }
+    else if(save_ret > 0) {
+        DEBUG_PRINT("Saved lifetime stats\n");
+    }
+}
+
+// Is a decision waiting on the power state, so the poller should run fast
+bool poll_window_open(void)
+{
+    if(poll_query_pending && sceKernelGetSystemTimeLow() - poll_query_time >= POLL_QUERY_WINDOW_US) {
+        poll_query_pending = false;
+    }
+
+    // Catch the switch being pressed during the lockout
+    clock_t hold_time_ago = sceKernelLibcClock() - ks_hot.hold_release_timestamp;
+    bool lockout = (ks_hot.hold_release_timestamp != 0) && (hold_time_ago < DISABLE_DURATION);
+
+    return poll_query_pending || !ks_hot.allow_sleep || lockout;
+}
+
+// Polling fallback: call power_callback_handler like the power service would have, when the state changes
+void poll_power_state(int extra_pwrflags)
+{
+    // Cleared before reading, a query blocked after this waits for the next poll
+    poll_sample_pending = false;
+    int pwrflags = ks_poll_pwrflags() | extra_pwrflags;
+    if(pwrflags != ks_hot.last_pwrflags || extra_pwrflags != 0) {
+        power_callback_handler(0, pwrflags, NULL);
+    }
+
+    ks_poll_set_interval(poll_window_open() ? POLL_FAST_US : POLL_IDLE_US);
+}
+
 // Set up and process callbacks
 int callback_thread(SceSize args, void *argp)
 {
@@ -219,22 +608,82 @@ int callback_thread(SceSize args, void *argp)
         }
     }
 
-    if(reg_callback_ret >= 0 && slot >= 0) {
+    bool registered = (reg_callback_ret >= 0 && slot >= 0);
+    if(registered) {
         DEBUG_PRINT("Power callback successfully registered in slot %i\n", slot);
-        DEBUG_PRINT("Now processing callbacks\n");
+    }
+    else {
+        // Keep the plugin working without a callback, at a slight cost
+        DEBUG_PRINT("Failed to register power callback in any slot! Falling back to polling\n");
+        int poll_ret = ks_poll_start(ks_hot.callback_evid, CALLBACK_EVENT_POLL, POLL_IDLE_US);
+        if(poll_ret >= 0) {
+            ks_hot.power_polling = true;
+        }
+        else {
+            DEBUG_PRINT("Failed to start polling: ret 0x%08x\n", poll_ret);
+        }
+    }
+
+    DEBUG_PRINT("Now processing callbacks\n");
+
+    ks_persist_init(MODULE_NAME);
+
+    DEBUG_FLUSH();
+
+    // Process callbacks until module_stop, saving the lifetime stats when asked to and on the interval
+    unsigned int persist_time = sceKernelGetSystemTimeLow();
+    for(;;) {
+        unsigned int event_bits = 0;
+        SceUInt timeout = PERSIST_INTERVAL_US;
+        int wait_ret = sceKernelWaitEventFlagCB(ks_hot.callback_evid,
+            CALLBACK_EVENT_STOP | CALLBACK_EVENT_PERSIST | CALLBACK_EVENT_POLL | CALLBACK_EVENT_RESUMED | CALLBACK_EVENT_LED,
+            PSP_EVENT_WAITOR | PSP_EVENT_WAITCLEAR, &event_bits, &timeout);
+        if(wait_ret < 0 && wait_ret != SCE_KERNEL_ERROR_WAIT_TIMEOUT) {
+            DEBUG_PRINT("Failed to wait for callback thread events: ret 0x%08x\n", wait_ret);
+            break;
+        }
+        if(event_bits & CALLBACK_EVENT_STOP) {
+            break;
+        }
+
+        // Leave the pad alone while suspending, the resume event picks up from here
+        if(event_bits & CALLBACK_EVENT_RESUMED) {
+            poll_power_state(PSP_POWER_CB_RESUME_COMPLETE);
+        }
+        else if((event_bits & CALLBACK_EVENT_POLL) && !ks_hot.suspend_in_progress) {
+            poll_power_state(0);
+        }
+
+        if(event_bits & CALLBACK_EVENT_LED) {
+            KS_LED_STEP();
+        }
+
+        // The interval can run out between the suspend starting and the Memory Stick going down
+        if(!ks_hot.suspend_in_progress
+            && ((event_bits & CALLBACK_EVENT_PERSIST) || sceKernelGetSystemTimeLow() - persist_time >= PERSIST_INTERVAL_US)) {
+            persist_time = sceKernelGetSystemTimeLow();
+            save_lifetime_stats();
+            DEBUG_FLUSH();
+        }
+    }
 
-        // Sleep and processing callbacks until we get woken up
-        sceKernelSleepThreadCB();
+    save_lifetime_stats();
 
-        // Cleanup
+    // Cleanup
+    KS_LED_EXIT();
+    if(registered) {
         reg_callback_ret = scePowerUnregisterCallback(slot);
         if(reg_callback_ret < 0) {
             // We can't really do anything about an error here except log it, although we don't expect this to error
             DEBUG_PRINT("Failed to unregister power callback from slot %i: ret 0x%08x\n", slot, reg_callback_ret);
         }
     }
-    else {
-        DEBUG_PRINT("Failed to register power callback in any slot!\n");
+    if(ks_hot.power_polling) {
+        int poll_ret = ks_poll_stop();
+        if(poll_ret < 0) {
+            DEBUG_PRINT("Failed to stop polling: ret 0x%08x\n", poll_ret);
+        }
+        ks_hot.power_polling = false;
     }
 
     // Cleanup
@@ -248,7 +697,43 @@ int callback_thread(SceSize args, void *argp)
     return 0;
 }
 
-int register_suspend_handler(void)
+// Called by the stats device before each read
+void ks_statdev_update_state(void)
+{
+    ks_record.state = (ks_hot.allow_sleep ? KS_STATE_ALLOW_SLEEP : 0) | (ks_hot.power_polling ? KS_STATE_POLLING : 0) | (ks_hot.hold_active ? KS_STATE_HOLD_ACTIVE : 0);
+    ks_record.hold_release_timestamp = ks_hot.hold_release_timestamp;
+    ks_record.consecutive_sleep_blocks = ks_hot.consecutive_sleep_blocks;
+}
+
+// User mode export, see killswitch_api.h
+int killswitchHoldGetStats(KsStatsRecord *record, int size)
+{
+    return ks_stats_copy_to_user(record, size);
+}
+
+KS_COLD int register_stats_device(void)
+{
+    DEBUG_PRINT("Registering stats device " STATS_DEVICE_NAME "0:\n");
+    int register_ret = ks_statdev_register(STATS_DEVICE_NAME, MODULE_NAME);
+    if(register_ret < 0) {
+        DEBUG_PRINT("Failed to register stats device: ret 0x%08x\n", register_ret);
+    }
+
+    return register_ret;
+}
+
+KS_COLD int unregister_stats_device(void)
+{
+    DEBUG_PRINT("Unregistering stats device\n");
+    int unregister_ret = ks_statdev_unregister();
+    if(unregister_ret < 0) {
+        DEBUG_PRINT("Failed to unregister stats device: ret 0x%08x\n", unregister_ret);
+    }
+
+    return unregister_ret;
+}
+
+KS_COLD int register_suspend_handler(void)
 {
     DEBUG_PRINT("Registering sysevent handler\n");
     int register_sysevent_ret = sceKernelRegisterSysEventHandler(&sys_event);
@@ -259,7 +744,7 @@ int register_suspend_handler(void)
     return register_sysevent_ret;
 }
 
-int unregister_suspend_handler(void)
+KS_COLD int unregister_suspend_handler(void)
 {
     DEBUG_PRINT("Unregistering sysevent handler\n");
     int unregister_sysevent_ret = sceKernelUnregisterSysEventHandler(&sys_event);
@@ -271,9 +756,19 @@ int unregister_suspend_handler(void)
 }
 
 // Starts callback thread
-int start_callbacks(void)
+KS_COLD int start_callbacks(void)
 {
     int result;
+
+    // Wakes the callback thread to save the lifetime stats or to exit
+    result = sceKernelCreateEventFlag(MODULE_NAME "Events", 0, 0, NULL);
+    if(result < 0) {
+        DEBUG_PRINT("Failed to create callback event flag: ret 0x%08x\n", result);
+        return result;
+    }
+    ks_hot.callback_evid = result;
+    KS_LED_INIT(ks_hot.callback_evid, CALLBACK_EVENT_LED);
+
     // name, entry, initPriority, stackSize, PspThreadAttributes, SceKernelThreadOptParam
     result = sceKernelCreateThread(MODULE_NAME "TaskCallbacks", callback_thread, 0x11, 0x800, 0, 0);
     if (result >= 0) {
@@ -291,15 +786,15 @@ int start_callbacks(void)
     return result;
 }
 
-int stop_callbacks(void)
+KS_COLD int stop_callbacks(void)
 {
     int result = 0;
     int thid = callback_thid;
     if(thid >= 0) {
-        // Unblock sceKernelSleepThreadCB() and have thread begin cleanup
-        result = sceKernelWakeupThread(thid);
+        // Unblock sceKernelWaitEventFlagCB() and have thread begin cleanup
+        result = sceKernelSetEventFlag(ks_hot.callback_evid, CALLBACK_EVENT_STOP);
         if(result < 0) {
-            DEBUG_PRINT("Failed to wakeup callback thread: ret 0x%08x\n", result);
+            DEBUG_PRINT("Failed to signal callback thread: ret 0x%08x\n", result);
         }
 
         // Wait for the callback thread to clean up and exit
@@ -331,17 +826,28 @@ int stop_callbacks(void)
         }
     }
 
+    // The event flag can go once nothing can wait on it
+    if(callback_thid < 0 && ks_hot.callback_evid >= 0) {
+        int delete_ret = sceKernelDeleteEventFlag(ks_hot.callback_evid);
+        if(delete_ret >= 0) {
+            ks_hot.callback_evid = -1;
+        }
+        else {
+            DEBUG_PRINT("Failed to delete callback event flag: ret 0x%08x\n", delete_ret);
+        }
+    }
+
     return result;
 }
 
 // Called during module init
-int module_start(SceSize args, void *argp)
+KS_COLD int module_start(SceSize args, void *argp)
 {
     int result;
 
-    #ifdef DEBUG
-    pspDebugScreenInit();
-    #endif
+    DEBUG_INIT();
+    KS_FAULT_LOAD(MODULE_NAME);
+    KS_POLICY_LOAD(MODULE_NAME);
 
     DEBUG_PRINT(MODULE_NAME " v" xstr(MAJOR_VER) "." xstr(MINOR_VER) " Module Start\n");
 
@@ -355,18 +861,27 @@ int module_start(SceSize args, void *argp)
         return MODULE_ERROR;
     }
 
+    // The stats device is only for monitoring, carry on without it if it can't be registered
+    register_stats_device();
+
+    // Same for the overlay
+    KS_OVERLAY_INIT();
+
     DEBUG_PRINT("Started.\n");
 
     return MODULE_OK;
 }
 
 // Called during module deinit
-int module_stop(SceSize args, void *argp)
+KS_COLD int module_stop(SceSize args, void *argp)
 {
     int result;
 
     DEBUG_PRINT("Stopping ...\n");
 
+    unregister_stats_device();
+    KS_OVERLAY_EXIT();
+
     result = unregister_suspend_handler();
     if(result < 0) {
         return MODULE_ERROR;
@@ -378,6 +893,10 @@ int module_stop(SceSize args, void *argp)
     }
 
     DEBUG_PRINT(MODULE_NAME " v" xstr(MAJOR_VER) "." xstr(MINOR_VER) " Module Stop\n");
+    // The callback thread has exited, so it's safe to flush from here
+    DEBUG_FLUSH();
 
     return MODULE_OK;
-}
\ No newline at end of file
+}
+
+#endif // KILLSWITCH_BENCH
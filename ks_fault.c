@@ -0,0 +1,206 @@
+// PSP-KillSwitch fault injection
+// Fault plan and .faults file parser, see ks_fault.h
+//
+// Ryan Crosby 2025
+
+#define KS_FAULT_IMPL
+#include "ks_fault.h"
+#include "ks_layout.h"
+#include "ks_path.h"
+
+#if defined(KILLSWITCH_FAULTS)
+
+#include <pspsdk.h>
+#include <pspiofilemgr.h>
+
+static KsFault plan[KS_FAULT_COUNT];
+
+unsigned int ks_fault_calls[KS_FAULT_COUNT];
+unsigned int ks_fault_hits[KS_FAULT_COUNT];
+
+// Names in the .faults file, in KS_FAULT_* order
+static const char *const fault_names[KS_FAULT_COUNT] = {
+    "ctrl_peek",
+    "create_callback",
+    "register_callback",
+    "register_sysevent",
+    "create_event_flag",
+    "create_thread",
+    "wait_thread_end",
+    "set_alarm",
+    "io_open",
+};
+
+void ks_fault_set(int fault, const KsFault *fault_plan)
+{
+    if(fault >= 0 && fault < KS_FAULT_COUNT) {
+        plan[fault] = *fault_plan;
+    }
+}
+
+void ks_fault_reset(void)
+{
+    int i;
+
+    for(i = 0; i < KS_FAULT_COUNT; i++) {
+        plan[i] = (KsFault){ 0 };
+        ks_fault_calls[i] = 0;
+        ks_fault_hits[i] = 0;
+    }
+}
+
+bool ks_fault_check(int fault, unsigned int arg)
+{
+    const KsFault *f = &plan[fault];
+    unsigned int call = ++ks_fault_calls[fault];
+
+    // Busy wait, the sysevent handler can't sleep
+    if(f->delay_us > 0) {
+        unsigned int start = sceKernelGetSystemTimeLow();
+        while(sceKernelGetSystemTimeLow() - start < f->delay_us) {
+        }
+    }
+
+    if(f->every == 0 || (call % f->every) != 0) {
+        return false;
+    }
+    if(f->arg_mask != 0 && (arg >= 32 || !(f->arg_mask & (1u << arg)))) {
+        return false;
+    }
+
+    ks_fault_hits[fault]++;
+    return true;
+}
+
+int ks_fault_error(int fault)
+{
+    return plan[fault].error;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parse a decimal or 0x hex number at *p, advancing past it. Returns false if there isn't one.
+static bool parse_number(const char **p, const char *end, unsigned int *value)
+{
+    const char *s = *p;
+    unsigned int base = 10;
+    unsigned int v = 0;
+
+    while(s < end && is_space(*s)) {
+        s++;
+    }
+    if(s + 1 < end && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        s += 2;
+    }
+
+    const char *digits = s;
+    for(; s < end; s++) {
+        unsigned int d;
+        if(*s >= '0' && *s <= '9') {
+            d = *s - '0';
+        }
+        else if(base == 16 && *s >= 'a' && *s <= 'f') {
+            d = *s - 'a' + 10;
+        }
+        else if(base == 16 && *s >= 'A' && *s <= 'F') {
+            d = *s - 'A' + 10;
+        }
+        else {
+            break;
+        }
+        v = v * base + d;
+    }
+    if(s == digits) {
+        return false;
+    }
+
+    *p = s;
+    *value = v;
+    return true;
+}
+
+// Parse one "<name> <every> <error> [delay_us] [arg_mask]" line. Returns true if it set a fault.
+static bool parse_line(const char *s, const char *end)
+{
+    int i;
+    KsFault f = { 0 };
+    unsigned int error;
+
+    while(s < end && is_space(*s)) {
+        s++;
+    }
+    if(s == end || *s == '#') {
+        return false;
+    }
+
+    const char *name = s;
+    while(s < end && !is_space(*s)) {
+        s++;
+    }
+    int name_len = s - name;
+
+    for(i = 0; i < KS_FAULT_COUNT; i++) {
+        int n;
+        for(n = 0; n < name_len && fault_names[i][n] == name[n]; n++) {
+        }
+        if(n == name_len && fault_names[i][n] == '\0') {
+            break;
+        }
+    }
+    if(i == KS_FAULT_COUNT) {
+        return false;
+    }
+
+    if(!parse_number(&s, end, &f.every) || !parse_number(&s, end, &error)) {
+        return false;
+    }
+    f.error = (int)error;
+
+    // Optional
+    if(parse_number(&s, end, &f.delay_us)) {
+        parse_number(&s, end, &f.arg_mask);
+    }
+
+    ks_fault_set(i, &f);
+    return true;
+}
+
+KS_COLD int ks_fault_load(const char *module_name)
+{
+    char path[64];
+    static char text[512];
+
+    ks_module_path(module_name, ".faults", path, sizeof(path));
+
+    SceUID fd = sceIoOpen(path, PSP_O_RDONLY, 0);
+    if(fd < 0) {
+        return 0;
+    }
+    int len = sceIoRead(fd, text, sizeof(text));
+    sceIoClose(fd);
+    if(len <= 0) {
+        return 0;
+    }
+
+    int faults = 0;
+    const char *line = text;
+    const char *end = text + len;
+    while(line < end) {
+        const char *eol = line;
+        while(eol < end && *eol != '\n') {
+            eol++;
+        }
+        if(parse_line(line, eol)) {
+            faults++;
+        }
+        line = eol + 1;
+    }
+
+    return faults;
+}
+
+#endif
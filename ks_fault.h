@@ -0,0 +1,105 @@
+// PSP-KillSwitch fault injection
+//
+// Building with -DKILLSWITCH_FAULTS=ON makes the SDK calls the plugins depend on fail or stall on demand, to check
+// how the plugins hold up when the system misbehaves: the pad read failing, callback slots taken, registration or
+// thread teardown failing. The decisions and their latency show up in the stats, the trace and the monitor as usual.
+//
+// Include this after the SDK headers. Each wrapped call becomes
+//   ks_fault_check(fault, arg) ? ks_fault_error(fault) : real_call(...)
+// so without KILLSWITCH_FAULTS nothing changes.
+//
+// The plan is set with ks_fault_set() (the handler bench does this), or loaded at module start from
+// ms0:/SEPLUGINS/<module>.faults, one fault per line:
+//   <name> <every> <error> [delay_us] [arg_mask]
+// every       fail every Nth call, 1 for every call, 0 to only add the delay
+// error       value returned instead of calling through, eg 0x80000021
+// delay_us    busy wait before the call, failed or not
+// arg_mask    register_callback only, the slots that fail, eg 0xFF00 takes slots 8-15. 0 for all.
+// Lines starting with # are ignored. Numbers are decimal, or hex with 0x.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_FAULT_H
+#define KS_FAULT_H
+
+#include <stdbool.h>
+
+// Wrapped calls, and their names in the .faults file
+#define KS_FAULT_CTRL_PEEK          0 // ctrl_peek          sceCtrlPeekBufferPositive
+#define KS_FAULT_CREATE_CALLBACK    1 // create_callback    sceKernelCreateCallback
+#define KS_FAULT_REGISTER_CALLBACK  2 // register_callback  scePowerRegisterCallback, arg is the slot
+#define KS_FAULT_REGISTER_SYSEVENT  3 // register_sysevent  sceKernelRegisterSysEventHandler
+#define KS_FAULT_CREATE_EVENT_FLAG  4 // create_event_flag  sceKernelCreateEventFlag
+#define KS_FAULT_CREATE_THREAD      5 // create_thread      sceKernelCreateThread
+#define KS_FAULT_WAIT_THREAD_END    6 // wait_thread_end    sceKernelWaitThreadEnd
+#define KS_FAULT_SET_ALARM          7 // set_alarm          sceKernelSetAlarm
+#define KS_FAULT_IO_OPEN            8 // io_open            sceIoOpen, for the lifetime stats
+#define KS_FAULT_COUNT              9
+
+typedef struct {
+    unsigned int every;
+    int error;
+    unsigned int delay_us;
+    unsigned int arg_mask;
+} KsFault;
+
+#if defined(KILLSWITCH_FAULTS)
+
+// Set or clear (every = 0, delay_us = 0) the fault for one call
+void ks_fault_set(int fault, const KsFault *plan);
+
+// Clear the whole plan and the call counters
+void ks_fault_reset(void);
+
+// Load the plan from ms0:/SEPLUGINS/<module>.faults, if there is one. Returns the number of faults set.
+int ks_fault_load(const char *module_name);
+
+// Calls made and calls failed, for each wrapped call
+extern unsigned int ks_fault_calls[KS_FAULT_COUNT];
+extern unsigned int ks_fault_hits[KS_FAULT_COUNT];
+
+// Count the call, apply the delay, and decide whether it fails
+bool ks_fault_check(int fault, unsigned int arg);
+int ks_fault_error(int fault);
+
+#define KS_FAULT_LOAD(module_name) ks_fault_load(module_name)
+
+// ks_fault.c calls through to the real functions
+#if !defined(KS_FAULT_IMPL)
+
+#define KS_FAULT_CALL(fault, arg, call) (ks_fault_check((fault), (unsigned int)(arg)) ? ks_fault_error(fault) : (call))
+
+// The handler bench sets this to read its replayed pad state behind the fault check
+#if !defined(KS_FAULT_CTRL_PEEK_FN)
+#define KS_FAULT_CTRL_PEEK_FN (sceCtrlPeekBufferPositive)
+#endif
+
+// The parentheses around the function name stop the macro expanding again
+#define sceCtrlPeekBufferPositive(pad, count) \
+    KS_FAULT_CALL(KS_FAULT_CTRL_PEEK, 0, KS_FAULT_CTRL_PEEK_FN(pad, count))
+#define sceKernelCreateCallback(name, func, arg) \
+    KS_FAULT_CALL(KS_FAULT_CREATE_CALLBACK, 0, (sceKernelCreateCallback)(name, func, arg))
+#define scePowerRegisterCallback(slot, cbid) \
+    KS_FAULT_CALL(KS_FAULT_REGISTER_CALLBACK, slot, (scePowerRegisterCallback)(slot, cbid))
+#define sceKernelRegisterSysEventHandler(handler) \
+    KS_FAULT_CALL(KS_FAULT_REGISTER_SYSEVENT, 0, (sceKernelRegisterSysEventHandler)(handler))
+#define sceKernelCreateEventFlag(name, attr, bits, opt) \
+    KS_FAULT_CALL(KS_FAULT_CREATE_EVENT_FLAG, 0, (sceKernelCreateEventFlag)(name, attr, bits, opt))
+#define sceKernelCreateThread(name, entry, priority, stack, attr, opt) \
+    KS_FAULT_CALL(KS_FAULT_CREATE_THREAD, 0, (sceKernelCreateThread)(name, entry, priority, stack, attr, opt))
+#define sceKernelWaitThreadEnd(thid, timeout) \
+    KS_FAULT_CALL(KS_FAULT_WAIT_THREAD_END, 0, (sceKernelWaitThreadEnd)(thid, timeout))
+#define sceKernelSetAlarm(clock, handler, common) \
+    KS_FAULT_CALL(KS_FAULT_SET_ALARM, 0, (sceKernelSetAlarm)(clock, handler, common))
+#define sceIoOpen(file, flags, mode) \
+    KS_FAULT_CALL(KS_FAULT_IO_OPEN, 0, (sceIoOpen)(file, flags, mode))
+
+#endif
+
+#else
+
+#define KS_FAULT_LOAD(module_name) do{ } while ( 0 )
+
+#endif
+
+#endif // KS_FAULT_H
@@ -0,0 +1,35 @@
+// PSP-KillSwitch code and data layout
+//
+// The suspend query is answered on ScePowerMain with the caches usually cold, since nothing in the plugin has run
+// for minutes. Keep what the switch and suspend path touches together, and everything else out of its way:
+//   KS_HOT        handlers on the switch/suspend path, placed together in .text.ks_hot
+//   KS_COLD       setup, teardown, logging and failure handling, moved into .text.unlikely
+//   KS_HOT_STATE  the plugin's hot variables, one struct aligned to a D-cache line
+//
+// The modules are built -G0, so there's no gp-relative small data. A single aligned struct gets the same effect,
+// every field is addressed off one base register and the whole query path costs one D-cache line fill.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_LAYOUT_H
+#define KS_LAYOUT_H
+
+// Allegrex I and D caches have 64 byte lines
+#define KS_CACHE_LINE 64
+
+// -DKILLSWITCH_HOT_COLD_LAYOUT=OFF leaves placement to the compiler, to compare against in the handler bench
+#if defined(KILLSWITCH_NO_LAYOUT)
+#define KS_HOT
+#define KS_COLD
+#define KS_HOT_STATE
+#else
+#define KS_HOT __attribute__((hot, section(".text.ks_hot")))
+#define KS_COLD __attribute__((cold))
+#define KS_HOT_STATE __attribute__((aligned(KS_CACHE_LINE)))
+#endif
+
+// Branch hints for the rare paths inside hot handlers
+#define KS_LIKELY(x) __builtin_expect(!!(x), 1)
+#define KS_UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+#endif // KS_LAYOUT_H
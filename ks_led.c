@@ -0,0 +1,95 @@
+// PSP-KillSwitch LED feedback
+// Alarm chained LED blink, see ks_led.h
+//
+// Ryan Crosby 2025
+
+#include "ks_led.h"
+#include "ks_layout.h"
+#include "ks_fault.h"
+
+#if defined(KILLSWITCH_LED)
+
+// The normal state of each LED, restored when the pattern ends
+static const int led_normal_state[] = {
+    [KS_LED_MS] = 0,
+    [KS_LED_WLAN] = 0,
+    [KS_LED_POWER] = 1,
+};
+
+static SceUID led_evid = -1;
+static unsigned int led_bits = 0;
+static SceUID led_alarm_id = -1;
+static int led_steps_left = 0;
+
+// Runs in interrupt context, hand the step over to the thread
+static SceUInt led_alarm(void *common)
+{
+    led_alarm_id = -1;
+    sceKernelSetEventFlag(led_evid, led_bits);
+    return 0;
+}
+
+KS_COLD void ks_led_init(SceUID evid, unsigned int bits)
+{
+    led_evid = evid;
+    led_bits = bits;
+}
+
+void ks_led_blink(void)
+{
+    if(led_evid < 0) {
+        return;
+    }
+
+    // Odd steps invert the LED, even ones restore it
+    int running = (led_steps_left > 0);
+    led_steps_left = KS_LED_BLINKS * 2;
+    if(!running) {
+        // Even the first step goes through the alarm, so syscon isn't called from the power callback
+        SceUID result = sceKernelSetAlarm(0, led_alarm, NULL);
+        if(result >= 0) {
+            led_alarm_id = result;
+        }
+        else {
+            led_steps_left = 0;
+        }
+    }
+}
+
+void ks_led_step(void)
+{
+    if(led_steps_left <= 0) {
+        return;
+    }
+
+    led_steps_left--;
+    int normal = led_normal_state[KS_LED_NUMBER];
+    sceSysconCtrlLED(KS_LED_NUMBER, (led_steps_left & 1) ? !normal : normal);
+
+    if(led_steps_left > 0) {
+        SceUID result = sceKernelSetAlarm(KS_LED_STEP_US, led_alarm, NULL);
+        if(result >= 0) {
+            led_alarm_id = result;
+        }
+        else {
+            // No alarm, no blink. Leave the LED as it should be.
+            led_steps_left = 0;
+            sceSysconCtrlLED(KS_LED_NUMBER, normal);
+        }
+    }
+}
+
+KS_COLD void ks_led_exit(void)
+{
+    if(led_alarm_id >= 0) {
+        sceKernelCancelAlarm(led_alarm_id);
+        led_alarm_id = -1;
+    }
+
+    if(led_steps_left > 0) {
+        led_steps_left = 0;
+        sceSysconCtrlLED(KS_LED_NUMBER, led_normal_state[KS_LED_NUMBER]);
+    }
+}
+
+#endif
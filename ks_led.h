@@ -0,0 +1,56 @@
+// PSP-KillSwitch LED feedback
+//
+// Building with -DKILLSWITCH_LED=ON blinks an LED when a power switch press is blocked, a lighter alternative to
+// the on-screen overlay. Syscon can't be driven from interrupt context, so each step of the pattern is a one-shot
+// kernel alarm that wakes the callback thread, which sets the LED and arms the alarm for the next step.
+// Nothing here runs in killswitchSysEventHandler.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_LED_H
+#define KS_LED_H
+
+// Syscon LED numbers
+#define KS_LED_MS       0   // Memory Stick access LED
+#define KS_LED_WLAN     1
+#define KS_LED_POWER    2
+
+// Which LED to blink, and how. The pattern alternates between the LED's inverted and normal state.
+#define KS_LED_NUMBER   KS_LED_MS
+#define KS_LED_BLINKS   3
+#define KS_LED_STEP_US  (120 * 1000)
+
+#if defined(KILLSWITCH_LED)
+
+#include <pspsdk.h>
+
+#define KS_LED_INIT(evid, bits) ks_led_init((evid), (bits))
+#define KS_LED_BLINK() ks_led_blink()
+#define KS_LED_STEP() ks_led_step()
+#define KS_LED_EXIT() ks_led_exit()
+
+// Each step sets bits in the event flag evid, the thread calls ks_led_step() when it sees them
+void ks_led_init(SceUID evid, unsigned int bits);
+
+// Start the pattern, or restart it if it's running. Callback thread only.
+void ks_led_blink(void);
+
+// Do the next step of the pattern. Callback thread only.
+void ks_led_step(void);
+
+// Cancel the pattern and leave the LED in its normal state
+void ks_led_exit(void);
+
+// sceSyscon_driver, imported by ks_syscon_stubs.S
+int sceSysconCtrlLED(int led, int state);
+
+#else
+
+#define KS_LED_INIT(evid, bits) do{ } while ( 0 )
+#define KS_LED_BLINK() do{ } while ( 0 )
+#define KS_LED_STEP() do{ } while ( 0 )
+#define KS_LED_EXIT() do{ } while ( 0 )
+
+#endif
+
+#endif // KS_LED_H
@@ -0,0 +1,154 @@
+// PSP-KillSwitch debug logging and tracing
+// Tokenized log ring, see ks_log.h
+//
+// Ryan Crosby 2025
+
+#include "ks_log.h"
+#include "ks_layout.h"
+#include "ks_path.h"
+
+#if defined(KS_LOG_RING)
+
+#include <pspsdk.h>
+#include <pspintrman.h>
+#include <pspiofilemgr.h>
+
+#include <stdarg.h>
+
+// Producers (callback thread, ScePowerMain) append at ring_head with interrupts suspended.
+// The single consumer, ks_log_flush(), reads from ring_tail and is the only writer of it.
+static unsigned int ring[KS_LOG_RING_WORDS];
+static volatile unsigned int ring_head = 0;
+static volatile unsigned int ring_tail = 0;
+static unsigned int dropped_records = 0;
+
+static char log_path[64];
+
+static void ring_put(unsigned int head, unsigned int word)
+{
+    ring[head % KS_LOG_RING_WORDS] = word;
+}
+
+static unsigned int ring_header(unsigned int id, unsigned int nargs, unsigned int kind)
+{
+    return (id & 0xFFFF) | (nargs << 16) | (kind << 24);
+}
+
+KS_COLD void ks_log_init(const char *module_name)
+{
+    ks_module_path(module_name, ".klog", log_path, sizeof(log_path));
+
+    ks_log_write(KS_LOG_ID_SESSION, 0);
+}
+
+// Reserve space for a record of nargs arguments and write its header.
+// Returns with interrupts suspended and *head pointing at the first argument, or -1 if the ring is full.
+static int ring_begin(unsigned int *head_out, unsigned int id, int nargs, unsigned int kind, int *intr_out)
+{
+    unsigned int timestamp = sceKernelGetSystemTimeLow();
+
+    int intr = sceKernelCpuSuspendIntr();
+
+    unsigned int head = ring_head;
+    unsigned int free_words = KS_LOG_RING_WORDS - (head - ring_tail);
+
+    // Leave room for the dropped record so an overflow is always reported
+    if(free_words < (unsigned int)(2 + nargs) + 3) {
+        dropped_records++;
+        sceKernelCpuResumeIntr(intr);
+        return -1;
+    }
+
+    if(dropped_records > 0) {
+        ring_put(head++, ring_header(KS_LOG_ID_DROPPED, 1, KS_LOG_KIND_PRINT));
+        ring_put(head++, timestamp);
+        ring_put(head++, dropped_records);
+        dropped_records = 0;
+    }
+
+    ring_put(head++, ring_header(id, nargs, kind));
+    ring_put(head++, timestamp);
+
+    *head_out = head;
+    *intr_out = intr;
+    return 0;
+}
+
+// Publish the record and resume interrupts
+static void ring_end(unsigned int head, int intr)
+{
+    ring_head = head;
+    sceKernelCpuResumeIntr(intr);
+}
+
+void ks_log_write(unsigned int id, int nargs, ...)
+{
+    va_list ap;
+    int i;
+    unsigned int head;
+    int intr;
+
+    if(ring_begin(&head, id, nargs, KS_LOG_KIND_PRINT, &intr) < 0) {
+        return;
+    }
+
+    va_start(ap, nargs);
+    for(i = 0; i < nargs; i++) {
+        ring_put(head++, va_arg(ap, unsigned int));
+    }
+    va_end(ap);
+
+    ring_end(head, intr);
+}
+
+void ks_log_trace(unsigned int event, unsigned int value)
+{
+    unsigned int head;
+    int intr;
+
+    // Look up the thread id before holding off interrupts
+    unsigned int thid = (unsigned int)sceKernelGetThreadId();
+
+    if(ring_begin(&head, event, 2, KS_LOG_KIND_TRACE, &intr) < 0) {
+        return;
+    }
+
+    ring_put(head++, thid);
+    ring_put(head++, value);
+
+    ring_end(head, intr);
+}
+
+KS_COLD void ks_log_flush(void)
+{
+    unsigned int tail = ring_tail;
+    unsigned int head = ring_head;
+
+    if(head == tail) {
+        return;
+    }
+
+    SceUID fd = sceIoOpen(log_path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_APPEND, 0777);
+    if(fd < 0) {
+        // Keep the records, they'll be written on the next flush or dropped once the ring fills up
+        return;
+    }
+
+    // Write the pending words in at most two pieces, wrapping around the end of the ring
+    unsigned int start = tail % KS_LOG_RING_WORDS;
+    unsigned int count = head - tail;
+    unsigned int first = KS_LOG_RING_WORDS - start;
+    if(first > count) {
+        first = count;
+    }
+
+    sceIoWrite(fd, &ring[start], first * sizeof(unsigned int));
+    if(count > first) {
+        sceIoWrite(fd, &ring[0], (count - first) * sizeof(unsigned int));
+    }
+    sceIoClose(fd);
+
+    ring_tail = head;
+}
+
+#endif
@@ -0,0 +1,134 @@
+// PSP-KillSwitch debug logging and tracing
+//
+// In debug builds each DEBUG_PRINT call site is compiled down to its source line number plus the raw arguments.
+// The format strings never make it into the module. Records are queued in a small RAM ring by ks_log_write()
+// and appended to ms0:/SEPLUGINS/<module>.klog by ks_log_flush() from thread context.
+//
+// tools/ks_logdict.py extracts the format strings from the plugin source into a dictionary at build time,
+// and tools/ks_logdecode.py turns the .klog back into text on the host.
+//
+// Building with -DKILLSWITCH_TRACE=ON also records KS_TRACE events (callbacks, pad samples, suspend queries and
+// decisions) into the same log, in any build type. tools/ks_trace2chrome.py converts them into a Chrome trace.
+//
+// Building with -DKILLSWITCH_LOG_SCREEN=ON prints the formatted text to the debug screen instead, as before.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_LOG_H
+#define KS_LOG_H
+
+#if defined(DEBUG) && defined(KILLSWITCH_LOG_SCREEN)
+#include <pspdebug.h>
+#include <pspdisplay.h>
+#endif
+
+// The log ring is needed for tokenized debug logs and for tracing
+#if (defined(DEBUG) && !defined(KILLSWITCH_LOG_SCREEN)) || defined(KILLSWITCH_TRACE)
+#define KS_LOG_RING
+#endif
+
+// Log file layout, little endian 32 bit words:
+//   [id:16 | nargs:8 | kind:8] [timestamp_us] [arg0] ... [argN-1]
+// For KS_LOG_KIND_PRINT records id is the source line of the DEBUG_PRINT call, or one of the reserved ids below.
+// For KS_LOG_KIND_TRACE records id is a KS_TRACE_* event, arg0 is the thread id and arg1 the event value.
+#define KS_LOG_KIND_PRINT   0
+#define KS_LOG_KIND_TRACE   1
+
+#define KS_LOG_ID_SESSION   0x0000 // Module started, no arguments
+#define KS_LOG_ID_DROPPED   0xFFFF // Ring overflowed, arg0 = number of records lost
+
+#define KS_LOG_MAX_ARGS     4
+
+// Ring size in words. Large enough to hold a full suspend sequence between flushes.
+#define KS_LOG_RING_WORDS   1024
+
+// Trace events
+#define KS_TRACE_CALLBACK_BEGIN     1 // power_callback_handler entered, value = pwrflags
+#define KS_TRACE_CALLBACK_END       2 // power_callback_handler returning
+#define KS_TRACE_PAD_SAMPLE         3 // Pad read for the button combo, value = buttons, or the error if < 0
+#define KS_TRACE_SYSEVENT_BEGIN     4 // killswitchSysEventHandler entered, value = event id
+#define KS_TRACE_SYSEVENT_END       5 // killswitchSysEventHandler returning, value = result
+#define KS_TRACE_DECISION           6 // allow_sleep changed or was confirmed, value = KS_DECISION(allow, reason)
+
+// Decision reasons
+#define KS_REASON_COMBO_HELD        1 // Override button combo held with the switch
+#define KS_REASON_NO_COMBO          2 // Switch pressed without the combo
+#define KS_REASON_PAD_ERROR         3 // Couldn't read the pad, failing open
+#define KS_REASON_EXTERNAL          4 // Suspend requested without the power switch
+#define KS_REASON_HOLD_LOCKOUT      5 // Switch pressed shortly after hold was released
+#define KS_REASON_NO_LOCKOUT        6 // Switch pressed outside the hold lockout
+#define KS_REASON_FAILSAFE          7 // MAX_CONSECUTIVE_SLEEPS reached
+#define KS_REASON_LOW_BATTERY       8 // Battery at or below LOW_BATTERY_PERCENT
+#define KS_REASON_IDLE              9 // No pad input for IDLE_ALLOW_MS
+#define KS_REASON_POLICY            10 // Decided by the policy program, see ks_policy.h
+
+#define KS_DECISION(allow, reason) (((allow) ? 1 : 0) | ((reason) << 8))
+
+#if defined(DEBUG) && defined(KILLSWITCH_LOG_SCREEN)
+
+#define DEBUG_PRINT(...) pspDebugScreenKprintf( __VA_ARGS__ )
+
+#elif defined(DEBUG)
+
+// Count 0-4 arguments, and cast each of them to a log word
+#define KS_LOG_NARGS(...) KS_LOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define KS_LOG_NARGS_(_0, _1, _2, _3, _4, n, ...) n
+#define KS_LOG_CAT(a, b) KS_LOG_CAT_(a, b)
+#define KS_LOG_CAT_(a, b) a ## b
+#define KS_LOG_WORD(a) ((unsigned int)(unsigned long)(a))
+#define KS_LOG_ARGS_0()
+#define KS_LOG_ARGS_1(a) , KS_LOG_WORD(a)
+#define KS_LOG_ARGS_2(a, b) , KS_LOG_WORD(a), KS_LOG_WORD(b)
+#define KS_LOG_ARGS_3(a, b, c) , KS_LOG_WORD(a), KS_LOG_WORD(b), KS_LOG_WORD(c)
+#define KS_LOG_ARGS_4(a, b, c, d) , KS_LOG_WORD(a), KS_LOG_WORD(b), KS_LOG_WORD(c), KS_LOG_WORD(d)
+
+// The format string is dropped here, only __LINE__ identifies it
+#define DEBUG_PRINT(fmt, ...) \
+    ks_log_write(__LINE__, KS_LOG_NARGS(__VA_ARGS__) KS_LOG_CAT(KS_LOG_ARGS_, KS_LOG_NARGS(__VA_ARGS__))(__VA_ARGS__))
+
+#else
+
+#define DEBUG_PRINT(...) do{ } while ( 0 )
+
+#endif
+
+#if defined(KS_LOG_RING)
+
+#if defined(DEBUG) && defined(KILLSWITCH_LOG_SCREEN)
+#define DEBUG_INIT() do{ pspDebugScreenInit(); ks_log_init(MODULE_NAME); } while ( 0 )
+#else
+#define DEBUG_INIT() ks_log_init(MODULE_NAME)
+#endif
+#define DEBUG_FLUSH() ks_log_flush()
+
+// Start a new log session. Called once from module_start.
+void ks_log_init(const char *module_name);
+
+// Queue a print record. Safe from any thread, including the sysevent handler, never blocks or does I/O.
+void ks_log_write(unsigned int id, int nargs, ...);
+
+// Queue a trace record for the current thread. Same rules as ks_log_write().
+void ks_log_trace(unsigned int event, unsigned int value);
+
+// Append queued records to the log file. Only call from the callback thread or after it has exited.
+void ks_log_flush(void);
+
+#elif defined(DEBUG) && defined(KILLSWITCH_LOG_SCREEN)
+
+#define DEBUG_INIT() pspDebugScreenInit()
+#define DEBUG_FLUSH() do{ } while ( 0 )
+
+#else
+
+#define DEBUG_INIT() do{ } while ( 0 )
+#define DEBUG_FLUSH() do{ } while ( 0 )
+
+#endif
+
+#if defined(KILLSWITCH_TRACE)
+#define KS_TRACE(event, value) ks_log_trace((event), (unsigned int)(value))
+#else
+#define KS_TRACE(event, value) do{ } while ( 0 )
+#endif
+
+#endif // KS_LOG_H
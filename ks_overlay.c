@@ -0,0 +1,126 @@
+// PSP-KillSwitch "sleep blocked" overlay
+// Vblank driven framebuffer icon, see ks_overlay.h
+//
+// Ryan Crosby 2025
+
+#include "ks_overlay.h"
+#include "ks_layout.h"
+
+#if defined(KILLSWITCH_OVERLAY)
+
+#include <pspsdk.h>
+#include <pspintrman.h>
+#include <pspdisplay.h>
+
+#define OVERLAY_SIZE    16
+#define OVERLAY_X       (480 - OVERLAY_SIZE - 8)
+#define OVERLAY_Y       8
+
+// Framebuffer writes go through the uncached mirror, so there's nothing to write back from the data cache
+#define UNCACHED(addr) ((void *)((unsigned long)(addr) | 0x40000000))
+
+// Power symbol, one row per entry, MSB is the leftmost pixel
+static const unsigned short overlay_sprite[OVERLAY_SIZE] = {
+    0x0180, 0x0180, 0x1998, 0x318C, 0x6186, 0x6186, 0xC183, 0xC003,
+    0xC003, 0xC003, 0x6006, 0x6006, 0x300C, 0x1C38, 0x0FF0, 0x03C0,
+};
+
+// Opaque red in each PSP_DISPLAY_PIXEL_FORMAT_*, which are all ABGR
+static const unsigned int overlay_colour[4] = {
+    0x001F,     // 565
+    0x801F,     // 5551
+    0xF00F,     // 4444
+    0xFF0000FF, // 8888
+};
+
+static int overlay_subintr = -1;
+static volatile int overlay_frames_left = 0;
+
+static void overlay_draw(void)
+{
+    void *topaddr;
+    int bufferwidth;
+    int pixelformat;
+    int x, y;
+
+    if(sceDisplayGetFrameBuf(&topaddr, &bufferwidth, &pixelformat, PSP_DISPLAY_SETBUF_IMMEDIATE) < 0
+        || topaddr == NULL || bufferwidth < OVERLAY_X + OVERLAY_SIZE || pixelformat < 0 || pixelformat > 3) {
+        return;
+    }
+
+    unsigned int colour = overlay_colour[pixelformat];
+    unsigned int row_start = OVERLAY_Y * bufferwidth + OVERLAY_X;
+
+    if(pixelformat == PSP_DISPLAY_PIXEL_FORMAT_8888) {
+        unsigned int *fb = (unsigned int *)UNCACHED(topaddr) + row_start;
+        for(y = 0; y < OVERLAY_SIZE; y++, fb += bufferwidth) {
+            for(x = 0; x < OVERLAY_SIZE; x++) {
+                if(overlay_sprite[y] & (0x8000 >> x)) {
+                    fb[x] = colour;
+                }
+            }
+        }
+    }
+    else {
+        unsigned short *fb = (unsigned short *)UNCACHED(topaddr) + row_start;
+        for(y = 0; y < OVERLAY_SIZE; y++, fb += bufferwidth) {
+            for(x = 0; x < OVERLAY_SIZE; x++) {
+                if(overlay_sprite[y] & (0x8000 >> x)) {
+                    fb[x] = (unsigned short)colour;
+                }
+            }
+        }
+    }
+}
+
+// Runs at the start of every vblank while enabled, after the game has flipped
+static int overlay_vblank(int sub, void *arg)
+{
+    if(overlay_frames_left <= 0) {
+        sceKernelDisableSubIntr(PSP_VBLANK_INT, overlay_subintr);
+        return -1;
+    }
+
+    overlay_frames_left--;
+    overlay_draw();
+
+    return -1;
+}
+
+KS_COLD int ks_overlay_init(void)
+{
+    int result = -1;
+    int slot;
+
+    // Other plugins use the low sub-interrupt numbers, search down from the top like the power callback slots
+    for(slot = 15; slot >= 0; slot--) {
+        result = sceKernelRegisterSubIntrHandler(PSP_VBLANK_INT, slot, overlay_vblank, NULL);
+        if(result >= 0) {
+            overlay_subintr = slot;
+            break;
+        }
+    }
+
+    return result;
+}
+
+void ks_overlay_show(void)
+{
+    if(overlay_subintr < 0) {
+        return;
+    }
+
+    overlay_frames_left = KS_OVERLAY_FRAMES;
+    sceKernelEnableSubIntr(PSP_VBLANK_INT, overlay_subintr);
+}
+
+KS_COLD void ks_overlay_exit(void)
+{
+    if(overlay_subintr >= 0) {
+        sceKernelDisableSubIntr(PSP_VBLANK_INT, overlay_subintr);
+        sceKernelReleaseSubIntrHandler(PSP_VBLANK_INT, overlay_subintr);
+        overlay_subintr = -1;
+    }
+}
+
+#endif
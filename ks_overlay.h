@@ -0,0 +1,39 @@
+// PSP-KillSwitch "sleep blocked" overlay
+//
+// Building with -DKILLSWITCH_OVERLAY=ON draws a small power icon into the corner of whatever is on screen for a couple
+// of seconds after a switch press is blocked, so it's clear the press was swallowed on purpose.
+// The icon is drawn from a vblank sub-interrupt straight into the displayed framebuffer, a 16x16 sprite per frame,
+// and the sub-interrupt is only enabled while the icon is showing.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_OVERLAY_H
+#define KS_OVERLAY_H
+
+// Frames to show the icon for after a block
+#define KS_OVERLAY_FRAMES 120
+
+#if defined(KILLSWITCH_OVERLAY)
+
+#define KS_OVERLAY_INIT() ks_overlay_init()
+#define KS_OVERLAY_SHOW() ks_overlay_show()
+#define KS_OVERLAY_EXIT() ks_overlay_exit()
+
+// Register the vblank sub-interrupt handler, disabled. Returns < 0 on failure.
+int ks_overlay_init(void);
+
+// Show the icon for KS_OVERLAY_FRAMES, or restart the count if it's showing. Safe from any thread.
+void ks_overlay_show(void);
+
+// Release the sub-interrupt handler again
+void ks_overlay_exit(void);
+
+#else
+
+#define KS_OVERLAY_INIT() do{ } while ( 0 )
+#define KS_OVERLAY_SHOW() do{ } while ( 0 )
+#define KS_OVERLAY_EXIT() do{ } while ( 0 )
+
+#endif
+
+#endif // KS_OVERLAY_H
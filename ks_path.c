@@ -0,0 +1,33 @@
+// PSP-KillSwitch file paths
+//
+// Ryan Crosby 2025
+
+#include "ks_path.h"
+#include "ks_layout.h"
+
+KS_COLD int ks_module_path(const char *module_name, const char *ext, char *buf, int size)
+{
+    int i;
+    int ext_len = 0;
+    const char *prefix = KS_PATH_DIR;
+    char *out = buf;
+    char *end = buf + size - 1;
+
+    while(ext[ext_len] != '\0') {
+        ext_len++;
+    }
+
+    // Build the path by hand, we don't link libc
+    for(i = 0; prefix[i] != '\0' && out < end; i++) {
+        *out++ = prefix[i];
+    }
+    for(i = 0; module_name[i] != '\0' && out < end - ext_len; i++) {
+        *out++ = module_name[i];
+    }
+    for(i = 0; ext[i] != '\0' && out < end; i++) {
+        *out++ = ext[i];
+    }
+    *out = '\0';
+
+    return out - buf;
+}
@@ -0,0 +1,15 @@
+// PSP-KillSwitch file paths
+// The files a plugin reads and writes live next to it, as ms0:/SEPLUGINS/<module>.<ext>
+//
+// Ryan Crosby 2025
+
+#ifndef KS_PATH_H
+#define KS_PATH_H
+
+#define KS_PATH_DIR "ms0:/SEPLUGINS/"
+
+// Write ms0:/SEPLUGINS/<module_name><ext> to buf, ext including the dot. The module name is cut short if the whole
+// path wouldn't fit in size bytes. Returns the length of the path.
+int ks_module_path(const char *module_name, const char *ext, char *buf, int size);
+
+#endif // KS_PATH_H
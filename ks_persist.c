@@ -0,0 +1,99 @@
+// PSP-KillSwitch lifetime statistics
+// Persisted decision counters, see ks_persist.h
+//
+// Ryan Crosby 2025
+
+#include <pspsdk.h>
+#include <pspintrman.h>
+#include <pspiofilemgr.h>
+
+#include "ks_stats.h"
+#include "ks_persist.h"
+#include "ks_layout.h"
+#include "ks_path.h"
+#include "ks_fault.h"
+
+// Totals loaded from the file, this session's counters are added on top
+static KsPersistRecord base;
+
+// Double buffered record: the snapshot is taken from the live counters with interrupts held off,
+// and only copied over the last written record once it's on the Memory Stick.
+static KsPersistRecord snapshot;
+static KsPersistRecord saved;
+static int saved_valid = 0;
+
+static char stats_path[64];
+
+static int record_equal(const KsPersistRecord *a, const KsPersistRecord *b)
+{
+    const unsigned int *wa = (const unsigned int *)a;
+    const unsigned int *wb = (const unsigned int *)b;
+    int i;
+
+    for(i = 0; i < (int)(sizeof(KsPersistRecord) / sizeof(unsigned int)); i++) {
+        if(wa[i] != wb[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+KS_COLD void ks_persist_init(const char *module_name)
+{
+    ks_module_path(module_name, ".stats", stats_path, sizeof(stats_path));
+
+    SceUID fd = sceIoOpen(stats_path, PSP_O_RDONLY, 0);
+    if(fd >= 0) {
+        int read_ret = sceIoRead(fd, &base, sizeof(base));
+        sceIoClose(fd);
+
+        // Older files are a prefix of the current layout, the fields they don't have start from zero.
+        // Anything else isn't ours, start again rather than add to garbage.
+        if(read_ret < 16 || base.magic != KS_PERSIST_MAGIC || base.version > KS_PERSIST_VERSION
+            || base.size > read_ret) {
+            base = (KsPersistRecord){ 0 };
+        }
+    }
+
+    base.magic = KS_PERSIST_MAGIC;
+    base.version = KS_PERSIST_VERSION;
+    base.size = sizeof(KsPersistRecord);
+    base.sessions++;
+}
+
+KS_COLD int ks_persist_save(void)
+{
+    // Interrupts are held off so the counters are consistent with each other
+    int intr = sceKernelCpuSuspendIntr();
+
+    snapshot = base;
+    snapshot.switch_presses += ks_record.stats.switch_presses;
+    snapshot.blocks += ks_record.stats.blocks;
+    snapshot.overrides += ks_record.stats.overrides;
+    snapshot.failsafe_trips += ks_record.stats.failsafe_trips;
+    snapshot.lockout_hits += ks_record.stats.lockout_hits;
+
+    sceKernelCpuResumeIntr(intr);
+
+    // Don't wear the Memory Stick for nothing. The first save of a session always goes out to record the session.
+    if(saved_valid && record_equal(&snapshot, &saved)) {
+        return 0;
+    }
+    snapshot.saves++;
+
+    SceUID fd = sceIoOpen(stats_path, PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC, 0777);
+    if(fd < 0) {
+        return fd;
+    }
+
+    int write_ret = sceIoWrite(fd, &snapshot, sizeof(snapshot));
+    sceIoClose(fd);
+    if(write_ret != sizeof(snapshot)) {
+        return (write_ret < 0) ? write_ret : -1;
+    }
+
+    saved = snapshot;
+    saved_valid = 1;
+    base.saves = saved.saves;
+    return 1;
+}
@@ -0,0 +1,39 @@
+// PSP-KillSwitch lifetime statistics
+//
+// The decision counters are accumulated in RAM and persisted to ms0:/SEPLUGINS/<module>.stats, so they survive
+// reboots. The file is rewritten in one piece, only from the callback thread and only when a counter has changed
+// since the last write, at a few clean points: after resuming from a suspend, on a long interval and at module_stop.
+// Never call into here from killswitchSysEventHandler.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_PERSIST_H
+#define KS_PERSIST_H
+
+#define KS_PERSIST_MAGIC    0x544C534B // "KSLT"
+#define KS_PERSIST_VERSION  1
+
+// File layout, little endian. Fields are only ever appended, bump KS_PERSIST_VERSION when they are.
+typedef struct {
+    unsigned int magic;                 // KS_PERSIST_MAGIC
+    unsigned short version;             // KS_PERSIST_VERSION
+    unsigned short size;                // sizeof(KsPersistRecord)
+    unsigned int sessions;              // Module starts
+    unsigned int saves;                 // Times this file has been written
+
+    // Lifetime totals of the matching KsStats counters
+    unsigned int switch_presses;
+    unsigned int blocks;
+    unsigned int overrides;
+    unsigned int failsafe_trips;
+    unsigned int lockout_hits;
+} KsPersistRecord;
+
+// Load the lifetime totals written by earlier sessions. Call once from the callback thread before saving.
+void ks_persist_init(const char *module_name);
+
+// Add this session's counters to the lifetime totals and write them out if they changed. Callback thread only.
+// Returns < 0 on an I/O error, the totals are kept and written again next time.
+int ks_persist_save(void);
+
+#endif // KS_PERSIST_H
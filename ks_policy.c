@@ -0,0 +1,216 @@
+// PSP-KillSwitch policy programs
+// Loader, verifier and interpreter, see ks_policy.h
+//
+// Ryan Crosby 2025
+
+#include "ks_policy.h"
+#include "ks_layout.h"
+#include "ks_path.h"
+
+#if defined(KILLSWITCH_POLICY)
+
+#include <pspsdk.h>
+#include <pspiofilemgr.h>
+
+static unsigned int program[KS_POLICY_MAX_INSNS];
+static int program_length = 0;
+
+static int stack_effect(unsigned int op)
+{
+    switch(op) {
+    case KS_POLICY_OP_CONST:
+    case KS_POLICY_OP_INPUT:
+        return 1;
+    case KS_POLICY_OP_NOT:
+    case KS_POLICY_OP_RET:
+        return 0;
+    default:
+        // JZ and the binary operators
+        return -1;
+    }
+}
+
+// How many values an instruction needs on the stack
+static int stack_needs(unsigned int op)
+{
+    switch(op) {
+    case KS_POLICY_OP_RET:
+    case KS_POLICY_OP_CONST:
+    case KS_POLICY_OP_INPUT:
+        return 0;
+    case KS_POLICY_OP_JZ:
+    case KS_POLICY_OP_NOT:
+        return 1;
+    default:
+        return 2;
+    }
+}
+
+KS_COLD int ks_policy_verify(const unsigned int *insns, int count)
+{
+    // Stack depth on entry to each instruction, -1 until a path reaches it
+    signed char depth[KS_POLICY_MAX_INSNS + 1];
+    int pc;
+
+    if(count <= 0 || count > KS_POLICY_MAX_INSNS) {
+        return -1;
+    }
+    for(pc = 0; pc <= count; pc++) {
+        depth[pc] = -1;
+    }
+    depth[0] = 0;
+
+    // Every jump goes forward, so one pass in order sees all the paths into an instruction before it
+    for(pc = 0; pc < count; pc++) {
+        unsigned int op = insns[pc] & 0xFF;
+        unsigned int arg = (insns[pc] >> 8) & 0xFF;
+        unsigned int imm = insns[pc] >> 16;
+        int d = depth[pc];
+
+        if(d < 0) {
+            // Unreachable, the compiler never emits it
+            return -2;
+        }
+        if(op >= KS_POLICY_OP_COUNT) {
+            return -3;
+        }
+        if((op == KS_POLICY_OP_RET && arg > KS_POLICY_BLOCK) || (op == KS_POLICY_OP_CONST && arg > 16)
+            || (op == KS_POLICY_OP_INPUT && arg >= KS_POLICY_INPUT_COUNT)) {
+            return -4;
+        }
+        if(d < stack_needs(op)) {
+            return -5;
+        }
+
+        int next = d + stack_effect(op);
+        if(next > KS_POLICY_MAX_STACK) {
+            return -6;
+        }
+
+        if(op == KS_POLICY_OP_JZ) {
+            int target = pc + 1 + (int)imm;
+            if(imm == 0 || target > count - 1) {
+                return -7;
+            }
+            if(depth[target] >= 0 && depth[target] != next) {
+                return -8;
+            }
+            depth[target] = next;
+        }
+
+        if(op != KS_POLICY_OP_RET) {
+            if(depth[pc + 1] >= 0 && depth[pc + 1] != next) {
+                return -8;
+            }
+            depth[pc + 1] = next;
+        }
+    }
+
+    // The last instruction has to be a return, nothing can fall off the end
+    if(depth[count] >= 0) {
+        return -9;
+    }
+    return 0;
+}
+
+KS_COLD int ks_policy_load(const char *module_name)
+{
+    int i;
+    char path[64];
+    static unsigned char data[8 + 4 * KS_POLICY_MAX_INSNS];
+    unsigned int insns[KS_POLICY_MAX_INSNS];
+
+    program_length = 0;
+
+    ks_module_path(module_name, ".kpol", path, sizeof(path));
+
+    SceUID fd = sceIoOpen(path, PSP_O_RDONLY, 0);
+    if(fd < 0) {
+        return 0;
+    }
+    int len = sceIoRead(fd, data, sizeof(data));
+    sceIoClose(fd);
+
+    if(len < 8 || data[0] != 'K' || data[1] != 'P' || data[2] != 'O' || data[3] != 'L' || data[4] != KS_POLICY_VERSION) {
+        return -1;
+    }
+    int count = data[5];
+    if(count > KS_POLICY_MAX_INSNS || len != 8 + 4 * count) {
+        return -1;
+    }
+    for(i = 0; i < count; i++) {
+        const unsigned char *word = &data[8 + 4 * i];
+        insns[i] = word[0] | (word[1] << 8) | (word[2] << 16) | ((unsigned int)word[3] << 24);
+    }
+
+    int verify_ret = ks_policy_verify(insns, count);
+    if(verify_ret < 0) {
+        return verify_ret;
+    }
+
+    for(i = 0; i < count; i++) {
+        program[i] = insns[i];
+    }
+    program_length = count;
+    return count;
+}
+
+bool ks_policy_active(void)
+{
+    return program_length > 0;
+}
+
+KS_HOT int ks_policy_eval(const unsigned int inputs[KS_POLICY_INPUT_COUNT])
+{
+    unsigned int stack[KS_POLICY_MAX_STACK];
+    int sp = 0;
+    int pc = 0;
+
+    // Verified at load, so no checks here. pc only increases and the program ends in a return.
+    while(pc < program_length) {
+        unsigned int insn = program[pc++];
+        unsigned int arg = (insn >> 8) & 0xFF;
+        unsigned int imm = insn >> 16;
+        unsigned int a, b;
+
+        switch(insn & 0xFF) {
+        case KS_POLICY_OP_RET:
+            return (int)arg;
+        case KS_POLICY_OP_CONST:
+            stack[sp++] = imm << arg;
+            break;
+        case KS_POLICY_OP_INPUT:
+            stack[sp++] = inputs[arg];
+            break;
+        case KS_POLICY_OP_JZ:
+            if(stack[--sp] == 0) {
+                pc += imm;
+            }
+            break;
+        case KS_POLICY_OP_NOT:
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+        default:
+            b = stack[--sp];
+            a = stack[sp - 1];
+            switch(insn & 0xFF) {
+            case KS_POLICY_OP_AND: a = a && b; break;
+            case KS_POLICY_OP_OR: a = a || b; break;
+            case KS_POLICY_OP_BOR: a = a | b; break;
+            case KS_POLICY_OP_HAS: a = (a & b) == b; break;
+            case KS_POLICY_OP_EQ: a = a == b; break;
+            case KS_POLICY_OP_NE: a = a != b; break;
+            case KS_POLICY_OP_LT: a = a < b; break;
+            case KS_POLICY_OP_LE: a = a <= b; break;
+            case KS_POLICY_OP_GT: a = a > b; break;
+            default: a = a >= b; break;
+            }
+            stack[sp - 1] = a;
+            break;
+        }
+    }
+
+    return KS_POLICY_DEFAULT;
+}
+
+#endif
@@ -0,0 +1,90 @@
+// PSP-KillSwitch policy programs
+//
+// Building with -DKILLSWITCH_POLICY=ON lets the power switch decision be made by a small program loaded at module start
+// from ms0:/SEPLUGINS/<module>.kpol, instead of only the rules compiled into the plugin. Programs are written as rules
+// and compiled on the PC with tools/ks_policyc.py, eg
+//   allow if buttons has HOME|SELECT
+//   block if hold_release_ms < 1000
+//   default
+// The program is verified when it's loaded, and ignored if it doesn't pass. Jumps only go forward, so a program runs
+// each instruction at most once and KS_POLICY_MAX_INSNS bounds the cost of every decision.
+//
+// A program returns KS_POLICY_ALLOW or KS_POLICY_BLOCK to decide the press itself, or KS_POLICY_DEFAULT to leave it to
+// the plugin's own rules. The low battery bypass and the failsafe still apply whatever it decides, and the program
+// doesn't run when the pad can't be read: the plugin's own rules decide the press, as they do without a program.
+// KillSwitch allows it, KillSwitchHold still applies its hold lockout.
+//
+// Program file: "KPOL", version, instruction count, two reserved bytes, then the instructions as little endian words
+//   [op:8 | arg:8 | imm:16]
+//
+// Ryan Crosby 2025
+
+#ifndef KS_POLICY_H
+#define KS_POLICY_H
+
+#include <stdbool.h>
+
+#define KS_POLICY_VERSION       1
+#define KS_POLICY_MAX_INSNS     64
+#define KS_POLICY_MAX_STACK     8
+
+// Results
+#define KS_POLICY_DEFAULT       0 // Decide with the plugin's own rules
+#define KS_POLICY_ALLOW         1
+#define KS_POLICY_BLOCK         2
+
+// Inputs, read with KS_POLICY_OP_INPUT
+#define KS_POLICY_IN_BUTTONS            0 // Pad buttons held
+#define KS_POLICY_IN_PAD_ERROR          1 // Always 0, the program doesn't run on a pad error
+#define KS_POLICY_IN_IDLE_MS            2 // ms since the last pad input, 0 unless KillSwitch tracks it (KILLSWITCH_IDLE_ALLOW_MS)
+#define KS_POLICY_IN_HOLD_RELEASE_MS    3 // ms since hold was switched off, 0xFFFFFFFF if it hasn't been or it isn't tracked
+#define KS_POLICY_IN_HOLD               4 // 1 if the hold switch is on
+#define KS_POLICY_IN_BATTERY            5 // Battery charge in percent, 0 without a battery
+#define KS_POLICY_IN_AC                 6 // 1 on AC power
+#define KS_POLICY_IN_LOW_BATTERY        7 // 1 if the battery is at or below KILLSWITCH_LOW_BATTERY_PERCENT or flagged low
+#define KS_POLICY_INPUT_COUNT           8
+
+// Instructions. Stack values are unsigned 32 bit, comparisons and logic push 0 or 1.
+#define KS_POLICY_OP_RET        0 // Return arg (a result)
+#define KS_POLICY_OP_CONST      1 // Push imm << arg, arg at most 16
+#define KS_POLICY_OP_INPUT      2 // Push input arg
+#define KS_POLICY_OP_JZ         3 // Pop, skip imm instructions if it's 0. imm >= 1, so jumps only go forward.
+#define KS_POLICY_OP_NOT        4 // a -> !a
+#define KS_POLICY_OP_AND        5 // a b -> a && b
+#define KS_POLICY_OP_OR         6 // a b -> a || b
+#define KS_POLICY_OP_BOR        7 // a b -> a | b
+#define KS_POLICY_OP_HAS        8 // a b -> (a & b) == b
+#define KS_POLICY_OP_EQ         9 // a b -> a == b
+#define KS_POLICY_OP_NE         10
+#define KS_POLICY_OP_LT         11
+#define KS_POLICY_OP_LE         12
+#define KS_POLICY_OP_GT         13
+#define KS_POLICY_OP_GE         14
+#define KS_POLICY_OP_COUNT      15
+
+#define KS_POLICY_INSN(op, arg, imm) ((unsigned int)(op) | ((unsigned int)(arg) << 8) | ((unsigned int)(imm) << 16))
+
+#if defined(KILLSWITCH_POLICY)
+
+// Load and verify ms0:/SEPLUGINS/<module>.kpol, if there is one. Returns the number of instructions, 0 if there's no
+// program, or < 0 if it was rejected.
+int ks_policy_load(const char *module_name);
+
+// Check a program can't run off the end, jump backwards, or under or overflow the stack. Returns 0 if it's fine.
+int ks_policy_verify(const unsigned int *insns, int count);
+
+// True if a verified program is loaded
+bool ks_policy_active(void);
+
+// Run the loaded program, returns KS_POLICY_DEFAULT, KS_POLICY_ALLOW or KS_POLICY_BLOCK
+int ks_policy_eval(const unsigned int inputs[KS_POLICY_INPUT_COUNT]);
+
+#define KS_POLICY_LOAD(module_name) ks_policy_load(module_name)
+
+#else
+
+#define KS_POLICY_LOAD(module_name) do{ } while ( 0 )
+
+#endif
+
+#endif // KS_POLICY_H
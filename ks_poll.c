@@ -0,0 +1,100 @@
+// PSP-KillSwitch polling fallback
+// Alarm driven power state polling, see ks_poll.h
+//
+// Ryan Crosby 2025
+
+#include <pspsdk.h>
+#include <psppower.h>
+#include <pspctrl.h>
+
+#include "ks_poll.h"
+#include "ks_layout.h"
+#include "ks_fault.h"
+
+static SceUID poll_alarm_id = -1;
+static SceUID poll_evid = -1;
+static unsigned int poll_bits = 0;
+static volatile SceUInt poll_interval = 0;
+
+// Runs in interrupt context, just wake the thread and go again
+static SceUInt poll_alarm(void *common)
+{
+    sceKernelSetEventFlag(poll_evid, poll_bits);
+    return poll_interval;
+}
+
+KS_COLD int ks_poll_start(SceUID evid, unsigned int bits, SceUInt interval_us)
+{
+    poll_evid = evid;
+    poll_bits = bits;
+    poll_interval = interval_us;
+
+    SceUID result = sceKernelSetAlarm(interval_us, poll_alarm, NULL);
+    if(result >= 0) {
+        poll_alarm_id = result;
+    }
+
+    return result;
+}
+
+KS_COLD int ks_poll_stop(void)
+{
+    int result = 0;
+
+    if(poll_alarm_id >= 0) {
+        result = sceKernelCancelAlarm(poll_alarm_id);
+        if(result >= 0) {
+            poll_alarm_id = -1;
+        }
+    }
+
+    return result;
+}
+
+void ks_poll_set_interval(SceUInt interval_us)
+{
+    SceUInt previous = poll_interval;
+    poll_interval = interval_us;
+
+    // Don't wait out a long idle interval before polling fast
+    if(interval_us < previous && poll_alarm_id >= 0 && sceKernelCancelAlarm(poll_alarm_id) >= 0) {
+        poll_alarm_id = sceKernelSetAlarm(interval_us, poll_alarm, NULL);
+    }
+}
+
+int ks_poll_battery_pwrflags(void)
+{
+    int pwrflags = 0;
+
+    if(scePowerIsPowerOnline() > 0) {
+        pwrflags |= PSP_POWER_CB_AC_POWER;
+    }
+    int percent = (scePowerIsBatteryExist() > 0) ? scePowerGetBatteryLifePercent() : -1;
+    if(percent >= 0) {
+        pwrflags |= PSP_POWER_CB_BATTERY_EXIST | (percent & PSP_POWER_CB_BATTPOWER);
+        if(scePowerIsLowBattery() > 0) {
+            pwrflags |= PSP_POWER_CB_BATTERY_LOW;
+        }
+    }
+
+    return pwrflags;
+}
+
+int ks_poll_pwrflags(void)
+{
+    int pwrflags = 0;
+    SceCtrlData pad_state;
+
+    if(sceCtrlPeekBufferPositive(&pad_state, 1) >= 0 && (pad_state.Buttons & PSP_CTRL_HOLD)) {
+        pwrflags |= PSP_POWER_CB_HOLD_SWITCH;
+    }
+
+    // There's no way to read the power switch itself, but pressing it raises a suspend request.
+    // So do the auto sleep timer and other external requests, they're decided as switch presses (see the README).
+    if(scePowerIsRequest() > 0) {
+        pwrflags |= PSP_POWER_CB_POWER_SWITCH;
+    }
+
+    // Same battery bits as a power callback, so the battery state stays cached
+    return pwrflags | ks_poll_battery_pwrflags();
+}
@@ -0,0 +1,32 @@
+// PSP-KillSwitch polling fallback
+//
+// Used when every power callback slot is taken. A kernel alarm wakes the callback thread, which reads the hold
+// switch and pending suspend requests and feeds them to power_callback_handler as synthesised pwrflags.
+// The plugin sets the poll interval after each poll, fast while a decision depends on it and slow otherwise.
+// With a callback registered, KillSwitch uses the same alarm to sample the pad for its idle policy.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_POLL_H
+#define KS_POLL_H
+
+#include <pspsdk.h>
+
+// Start the alarm. Each time it fires, bits are set in the event flag evid.
+int ks_poll_start(SceUID evid, unsigned int bits, SceUInt interval_us);
+
+// Cancel the alarm again
+int ks_poll_stop(void);
+
+// Change the poll interval. A shorter interval replaces the pending alarm, a longer one applies after it fires.
+void ks_poll_set_interval(SceUInt interval_us);
+
+// Read the current state as PSP_POWER_CB_HOLD_SWITCH, PSP_POWER_CB_POWER_SWITCH for a pending suspend request,
+// and the battery and AC power bits. Thread context only.
+int ks_poll_pwrflags(void);
+
+// Just the battery and AC power bits. These come from the power service's own cached battery state, without
+// asking syscon, so this is safe from an alarm.
+int ks_poll_battery_pwrflags(void);
+
+#endif // KS_POLL_H
@@ -0,0 +1,205 @@
+// PSP-KillSwitch stats device
+// Read-only I/O driver and user mode export exposing ks_record, see ks_statdev.h
+//
+// Ryan Crosby 2025
+
+#include <pspsdk.h>
+#include <pspintrman.h>
+#include <pspiofilemgr.h>
+#include <pspiofilemgr_kernel.h>
+
+#include "ks_stats.h"
+#include "ks_statdev.h"
+#include "ks_layout.h"
+
+// https://github.com/uofw/uofw/blob/7ca6ba13966a38667fa7c5c30a428ccd248186cf/include/common/errors.h
+#define SCE_ERROR_ERRNO_EINVAL                      0x80010016
+#define SCE_ERROR_ERRNO_EROFS                       0x8001001E
+#define SCE_ERROR_ERRNO_ENOTSUP                     0x80010086
+#define SCE_ERROR_PRIV_REQUIRED                     0x80000023
+
+// The caller's buffer is acceptable if it doesn't reach into kernel memory when called from user mode.
+// https://github.com/uofw/uofw/blob/7ca6ba13966a38667fa7c5c30a428ccd248186cf/include/common/common_header.h
+#define K1_BUF_OK(k1, addr, size) \
+    ((int)((((unsigned int)(unsigned long)(addr)) | ((unsigned int)(unsigned long)(addr) + (size)) | (size)) & (k1)) >= 0)
+
+static const char *driver_name = NULL;
+
+static int statdev_init(PspIoDrvArg *arg)
+{
+    return 0;
+}
+
+static int statdev_exit(PspIoDrvArg *arg)
+{
+    return 0;
+}
+
+static int statdev_open(PspIoDrvFileArg *arg, char *file, int flags, SceMode mode)
+{
+    if(flags & (PSP_O_WRONLY | PSP_O_CREAT | PSP_O_TRUNC | PSP_O_APPEND)) {
+        return SCE_ERROR_ERRNO_EROFS;
+    }
+
+    // The read offset lives in the per-file argument, there's nothing to allocate
+    arg->arg = (void *)0;
+    return 0;
+}
+
+static int statdev_close(PspIoDrvFileArg *arg)
+{
+    return 0;
+}
+
+// Copy part of the record straight out of the live one, returns the number of bytes copied
+static int stats_read(unsigned int offset, char *data, int len)
+{
+    if(len < 0) {
+        return SCE_ERROR_ERRNO_EINVAL;
+    }
+    if(offset >= sizeof(ks_record)) {
+        return 0;
+    }
+    if((unsigned int)len > sizeof(ks_record) - offset) {
+        len = sizeof(ks_record) - offset;
+    }
+
+    // Interrupts are held off so the counters are consistent with each other
+    int intr = sceKernelCpuSuspendIntr();
+
+    ks_record.timestamp = sceKernelGetSystemTimeLow();
+    ks_statdev_update_state();
+
+    const char *src = (const char *)&ks_record + offset;
+    int i;
+    for(i = 0; i < len; i++) {
+        data[i] = src[i];
+    }
+
+    sceKernelCpuResumeIntr(intr);
+
+    return len;
+}
+
+static int statdev_read(PspIoDrvFileArg *arg, char *data, int len)
+{
+    unsigned int offset = (unsigned int)(unsigned long)arg->arg;
+
+    int result = stats_read(offset, data, len);
+    if(result > 0) {
+        arg->arg = (void *)(unsigned long)(offset + result);
+    }
+
+    return result;
+}
+
+static int statdev_write(PspIoDrvFileArg *arg, const char *data, int len)
+{
+    return SCE_ERROR_ERRNO_EROFS;
+}
+
+static SceOff statdev_lseek(PspIoDrvFileArg *arg, SceOff ofs, int whence)
+{
+    SceOff base;
+
+    switch(whence) {
+        case PSP_SEEK_SET: base = 0; break;
+        case PSP_SEEK_CUR: base = (unsigned int)(unsigned long)arg->arg; break;
+        case PSP_SEEK_END: base = sizeof(ks_record); break;
+        default: return SCE_ERROR_ERRNO_EINVAL;
+    }
+
+    // The position is kept in the 32 bit arg, so a seek past that would wrap back into the record
+    if(base + ofs < 0 || base + ofs > 0xFFFFFFFF) {
+        return SCE_ERROR_ERRNO_EINVAL;
+    }
+
+    arg->arg = (void *)(unsigned long)(base + ofs);
+    return base + ofs;
+}
+
+static int statdev_ioctl(PspIoDrvFileArg *arg, unsigned int cmd, void *indata, int inlen, void *outdata, int outlen)
+{
+    return SCE_ERROR_ERRNO_ENOTSUP;
+}
+
+static int statdev_devctl(PspIoDrvFileArg *arg, const char *devname, unsigned int cmd, void *indata, int inlen, void *outdata, int outlen)
+{
+    return SCE_ERROR_ERRNO_ENOTSUP;
+}
+
+static PspIoDrvFuncs statdev_funcs = {
+    .IoInit = statdev_init,
+    .IoExit = statdev_exit,
+    .IoOpen = statdev_open,
+    .IoClose = statdev_close,
+    .IoRead = statdev_read,
+    .IoWrite = statdev_write,
+    .IoLseek = statdev_lseek,
+    .IoIoctl = statdev_ioctl,
+    .IoDevctl = statdev_devctl,
+};
+
+static PspIoDrv statdev_driver = {
+    .name = NULL,
+    .dev_type = 0x10,
+    .unk2 = 0x800,
+    .name2 = NULL,
+    .funcs = &statdev_funcs,
+};
+
+KS_COLD int ks_statdev_register(const char *name, const char *module_name)
+{
+    int i;
+
+    ks_record.magic = KS_STATS_MAGIC;
+    ks_record.version = KS_STATS_VERSION;
+    ks_record.size = sizeof(ks_record);
+    ks_record.stats_mask = KILLSWITCH_STATS_MASK;
+    for(i = 0; i < (int)sizeof(ks_record.module) - 1 && module_name[i] != '\0'; i++) {
+        ks_record.module[i] = module_name[i];
+    }
+
+    statdev_driver.name = name;
+    statdev_driver.name2 = name;
+
+    int result = sceIoAddDrv(&statdev_driver);
+    if(result >= 0) {
+        driver_name = name;
+    }
+
+    return result;
+}
+
+KS_COLD int ks_statdev_unregister(void)
+{
+    int result = 0;
+
+    if(driver_name != NULL) {
+        result = sceIoDelDrv(driver_name);
+        if(result >= 0) {
+            driver_name = NULL;
+        }
+    }
+
+    return result;
+}
+
+int ks_stats_copy_to_user(void *record, int size)
+{
+    unsigned int k1 = pspSdkSetK1(0);
+    int result;
+
+    if(size < 0) {
+        result = SCE_ERROR_ERRNO_EINVAL;
+    }
+    else if(!K1_BUF_OK(k1, record, size)) {
+        result = SCE_ERROR_PRIV_REQUIRED;
+    }
+    else {
+        result = stats_read(0, record, size);
+    }
+
+    pspSdkSetK1(k1);
+    return result;
+}
@@ -0,0 +1,24 @@
+// PSP-KillSwitch stats device
+//
+// Registers a tiny read-only I/O driver, so any homebrew (or a CFW file browser) can open eg "ks0:" and read
+// the plugin's KsStatsRecord (ks_stats.h) with plain sceIoOpen/sceIoRead. No exports to link against.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_STATDEV_H
+#define KS_STATDEV_H
+
+// Register the driver as <name>0:. Returns < 0 on failure.
+int ks_statdev_register(const char *name, const char *module_name);
+
+// Remove the driver again
+int ks_statdev_unregister(void);
+
+// Copy up to size bytes of the record into a caller's buffer, for the user mode exports.
+// Returns the number of bytes copied, callers with an older, shorter KsStatsRecord get a prefix of it.
+int ks_stats_copy_to_user(void *record, int size);
+
+// Implemented by the plugin. Refresh the state fields of ks_record before it's read.
+void ks_statdev_update_state(void);
+
+#endif // KS_STATDEV_H
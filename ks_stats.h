@@ -0,0 +1,116 @@
+// PSP-KillSwitch statistics counters
+//
+// Counters are compiled into release builds too, each one costs a single increment where it's counted.
+// Every counter belongs to a category, and categories that are not in KILLSWITCH_STATS_MASK compile out entirely.
+// Both plugins share the same layout, counters that don't apply to a plugin stay at zero.
+//
+// Ryan Crosby 2025
+
+#ifndef KS_STATS_H
+#define KS_STATS_H
+
+// Counter categories
+#define KS_STATS_CORE       0x00000001 // Decisions and failures, always compiled in
+#define KS_STATS_VERBOSE    0x00000002 // Every event seen, enabled with -DKILLSWITCH_VERBOSE_STATS=ON
+#define KS_STATS_LATENCY    0x00000004 // Latency histograms, disabled with -DKILLSWITCH_LATENCY_STATS=OFF
+
+#ifdef KILLSWITCH_VERBOSE_STATS
+#define KS_STATS_MASK_VERBOSE KS_STATS_VERBOSE
+#else
+#define KS_STATS_MASK_VERBOSE 0
+#endif
+
+#ifdef KILLSWITCH_NO_LATENCY_STATS
+#define KS_STATS_MASK_LATENCY 0
+#else
+#define KS_STATS_MASK_LATENCY KS_STATS_LATENCY
+#endif
+
+#define KILLSWITCH_STATS_MASK (KS_STATS_CORE | KS_STATS_MASK_VERBOSE | KS_STATS_MASK_LATENCY)
+
+// Histograms have power of two buckets, bucket i counts values in [2^i, 2^(i+1)), bucket 0 also counts 0.
+// The last bucket collects everything larger.
+#define KS_HIST_BUCKETS     16
+
+typedef struct {
+    // KS_STATS_CORE
+    unsigned int callbacks;             // Power callbacks received
+    unsigned int switch_presses;        // Power callbacks with the power switch pressed
+    unsigned int blocks;                // Suspend queries refused
+    unsigned int allows;                // Suspend queries let through
+    unsigned int failsafe_trips;        // Queries let through because MAX_CONSECUTIVE_SLEEPS was reached
+    unsigned int pad_read_failures;     // sceCtrlPeekBufferPositive() failures (KillSwitch)
+    unsigned int overrides;             // Switch presses with the button combo held (KillSwitch)
+    unsigned int lockout_hits;          // Switch presses during the hold lockout (KillSwitchHold)
+
+    // KS_STATS_VERBOSE
+    unsigned int suspend_cancellations; // SCE_SYSTEM_SUSPEND_EVENT_CANCELLATION events
+    unsigned int suspend_starts;        // SCE_SYSTEM_SUSPEND_EVENT_START events
+    unsigned int hold_edges;            // Hold switch changes (KillSwitchHold)
+    unsigned int external_requests;     // Blocks cleared by a callback without the power switch, eg a remote standby
+
+    // KS_STATS_LATENCY
+    unsigned int query_latency_ms[KS_HIST_BUCKETS];     // Power switch callback to the following suspend query, ms
+    unsigned int callback_duration_us[KS_HIST_BUCKETS]; // Time spent in power_callback_handler, us
+
+    // KS_STATS_CORE, version 3
+    unsigned int missed_callbacks;      // Suspend queries with no power callback handled since the previous query
+    unsigned int collapsed_callbacks;   // Power callbacks with the same flags as the last one, edges were lost
+
+    // KS_STATS_CORE, version 4
+    unsigned int hold_bounces;          // Hold switch changes rejected by the debounce (KillSwitchHold)
+
+    // KS_STATS_CORE, version 5
+    unsigned int low_battery_bypasses;  // Blocks dropped because the battery was nearly empty (KillSwitch)
+
+    // KS_STATS_CORE, version 6
+    unsigned int idle_allows;           // Switch presses allowed without the combo, no recent pad input (KillSwitch)
+} KsStats;
+
+#define KS_STATS_MAGIC      0x5453534B // "KSST"
+#define KS_STATS_VERSION    6
+
+// State bits in KsStatsRecord.state
+#define KS_STATE_ALLOW_SLEEP    0x00000001
+#define KS_STATE_HOLD_ACTIVE    0x00000002
+#define KS_STATE_POLLING        0x00000004 // No power callback slot was free, polling instead
+
+// Fixed layout record read from the stats device (ks0: / ksh0:), see ks_statdev.h.
+// The live counters are kept inside the record so a read copies straight out of it.
+// Fields are only ever appended, bump KS_STATS_VERSION when they are.
+typedef struct {
+    unsigned int magic;                 // KS_STATS_MAGIC
+    unsigned short version;             // KS_STATS_VERSION
+    unsigned short size;                // sizeof(KsStatsRecord)
+    char module[16];                    // MODULE_NAME of the plugin
+    unsigned int stats_mask;            // KILLSWITCH_STATS_MASK the plugin was built with
+
+    // Refreshed on every read
+    unsigned int timestamp;             // sceKernelGetSystemTimeLow() at the time of the read
+    unsigned int state;                 // KS_STATE_* bits
+    int consecutive_sleep_blocks;
+    unsigned int hold_release_timestamp; // sceKernelLibcClock() of the last hold release, 0 if none (KillSwitchHold)
+
+    KsStats stats;
+} KsStatsRecord;
+
+extern KsStatsRecord ks_record;
+
+// True when a category is compiled in, for code that only exists to feed a counter
+#define KS_STAT_ENABLED(category) (((KILLSWITCH_STATS_MASK) & (category)) != 0)
+
+// Count an event. Compiles to nothing when the category is masked out.
+#define KS_STAT_INC(category, counter) \
+    do { if((KILLSWITCH_STATS_MASK) & (category)) { ks_record.stats.counter++; } } while ( 0 )
+
+// Add a value to a histogram. The bucket is found with a single clz.
+#define KS_STAT_HIST(category, histogram, value) \
+    do { if((KILLSWITCH_STATS_MASK) & (category)) { ks_record.stats.histogram[ks_hist_bucket(value)]++; } } while ( 0 )
+
+static inline unsigned int ks_hist_bucket(unsigned int value)
+{
+    unsigned int bucket = (value == 0) ? 0 : (31 - __builtin_clz(value));
+    return (bucket < KS_HIST_BUCKETS) ? bucket : (KS_HIST_BUCKETS - 1);
+}
+
+#endif // KS_STATS_H
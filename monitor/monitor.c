@@ -0,0 +1,104 @@
+// PSP-KillSwitch monitor
+// Companion homebrew that shows the live counters, latency histograms and state of the loaded plugins.
+//
+// The screen is refreshed once per vblank. Each refresh makes a single killswitchGetStats / killswitchHoldGetStats
+// call per plugin, so the monitor doesn't disturb what it measures. Press START to exit.
+//
+// Ryan Crosby 2025
+
+#include <pspkernel.h>
+#include <pspdebug.h>
+#include <pspdisplay.h>
+#include <pspctrl.h>
+
+#include "killswitch_api.h"
+
+#define MAJOR_VER 1
+#define MINOR_VER 0
+
+PSP_MODULE_INFO("KillSwitchMonitor", PSP_MODULE_USER, MAJOR_VER, MINOR_VER);
+PSP_MAIN_THREAD_ATTR(PSP_THREAD_ATTR_USER);
+
+#define printf pspDebugScreenPrintf
+
+static KsStatsRecord records[2];
+
+static void print_histogram(const char *name, const char *unit, const unsigned int *buckets)
+{
+    int i;
+
+    printf("  %s (%s, bucket >=):\n ", name, unit);
+    for(i = 0; i < KS_HIST_BUCKETS; i++) {
+        printf(" %5u:%-5u", (i == 0) ? 0 : (1u << i), buckets[i]);
+        if(i % 5 == 4) {
+            printf("\n ");
+        }
+    }
+    printf("\n");
+}
+
+static void print_record(const char *name, int result, const KsStatsRecord *record)
+{
+    if(result < 0) {
+        printf("%-16s not loaded (0x%08x)                              \n\n", name, result);
+        return;
+    }
+    if(result < (int)sizeof(*record) || record->magic != KS_STATS_MAGIC || record->version != KS_STATS_VERSION) {
+        printf("%-16s unsupported record (v%u, %i bytes)                  \n\n", name, record->version, result);
+        return;
+    }
+
+    const KsStats *stats = &record->stats;
+
+    printf("%-16s %s  blocks in a row %-3i %s %s\n", record->module,
+        (record->state & KS_STATE_ALLOW_SLEEP) ? "sleep allowed " : "sleep BLOCKED ",
+        record->consecutive_sleep_blocks,
+        (record->state & KS_STATE_HOLD_ACTIVE) ? "HOLD" : "    ",
+        (record->state & KS_STATE_POLLING) ? "POLL" : "    ");
+    printf("  callbacks %-6u presses %-6u blocks %-6u allows %-6u\n",
+        stats->callbacks, stats->switch_presses, stats->blocks, stats->allows);
+    printf("  failsafe  %-6u pad err %-6u overr. %-6u lockout %-6u\n",
+        stats->failsafe_trips, stats->pad_read_failures, stats->overrides, stats->lockout_hits);
+    printf("  missed cb %-6u collapsed %-6u bounces %-6u low batt %-6u\n",
+        stats->missed_callbacks, stats->collapsed_callbacks, stats->hold_bounces, stats->low_battery_bypasses);
+    printf("  idle      %-6u                                            \n", stats->idle_allows);
+
+    if(record->stats_mask & KS_STATS_VERBOSE) {
+        printf("  cancels   %-6u starts  %-6u holds  %-6u extern %-6u\n",
+            stats->suspend_cancellations, stats->suspend_starts, stats->hold_edges, stats->external_requests);
+    }
+
+    if(record->stats_mask & KS_STATS_LATENCY) {
+        print_histogram("switch to query", "ms", stats->query_latency_ms);
+        print_histogram("callback duration", "us", stats->callback_duration_us);
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    SceCtrlData pad;
+
+    pspDebugScreenInit();
+
+    for(;;) {
+        // One batched call per plugin per frame
+        int ks_result = killswitchGetStats(&records[0], sizeof(records[0]));
+        int ksh_result = killswitchHoldGetStats(&records[1], sizeof(records[1]));
+
+        sceDisplayWaitVblankStart();
+
+        pspDebugScreenSetXY(0, 0);
+        printf("KillSwitch monitor v%i.%i, START to exit\n\n", MAJOR_VER, MINOR_VER);
+        print_record("KillSwitch", ks_result, &records[0]);
+        print_record("KillSwitchHold", ksh_result, &records[1]);
+
+        if(sceCtrlPeekBufferPositive(&pad, 1) >= 0 && (pad.Buttons & PSP_CTRL_START)) {
+            break;
+        }
+    }
+
+    sceKernelExitGame();
+    return 0;
+}
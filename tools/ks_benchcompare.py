@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+"""Compare two handler bench runs and flag regressions beyond the noise.
+
+Usage: ks_benchcompare.py base/KillSwitchBench.json new/KillSwitchBench.json [--threshold 5]
+
+Takes the JSON the bench EBOOT writes next to itself. Every scenario is matched by pass (warm/cold) and name, and its
+median cycles per call compared. A change only counts if it's more than --threshold percent of the base median,
+more than --floor cycles, and more than the spread (interquartile range) of either run.
+
+Runs of two plugin variants can be compared the same way, eg KillSwitchBench.json against KillSwitchThreadlessBench.json,
+scenarios only one of them has are listed but not judged.
+
+Exits 1 if anything regressed.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path, encoding='utf-8') as f:
+        run = json.load(f)
+    results = {}
+    for result in run['results']:
+        samples = sorted(result['samples'])
+        results[(result['pass'], result['name'])] = samples
+    return run, results
+
+
+def quantile(samples, q):
+    return samples[min(len(samples) - 1, int(q * len(samples)))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('base', help='bench JSON to compare against')
+    parser.add_argument('new', help='bench JSON of the change')
+    parser.add_argument('--threshold', type=float, default=5.0, help='percent change that counts, default 5')
+    parser.add_argument('--floor', type=float, default=0.5, help='cycles per call that count, default 0.5')
+    args = parser.parse_args()
+
+    base_run, base = load(args.base)
+    new_run, new = load(args.new)
+
+    print(f'base: {base_run["module"]} v{base_run["version"]} @ {base_run["cpu_mhz"]}MHz')
+    print(f'new:  {new_run["module"]} v{new_run["version"]} @ {new_run["cpu_mhz"]}MHz')
+    if base_run['cpu_mhz'] != new_run['cpu_mhz']:
+        print('warning: the runs were at different CPU clocks, memory bound code doesn\'t scale with it', file=sys.stderr)
+    print()
+    print(f'{"pass":<5} {"scenario":<20} {"base":>8} {"new":>8} {"change":>8}')
+
+    regressions = 0
+    for key in sorted(set(base) | set(new)):
+        pass_name, name = key
+        if key not in base or key not in new:
+            only = args.base if key in base else args.new
+            print(f'{pass_name:<5} {name:<20} only in {only}')
+            continue
+
+        # Centicycles to cycles
+        base_median = quantile(base[key], 0.5) / 100
+        new_median = quantile(new[key], 0.5) / 100
+        spread = max(quantile(s, 0.75) - quantile(s, 0.25) for s in (base[key], new[key])) / 100
+        delta = new_median - base_median
+        percent = (delta * 100 / base_median) if base_median > 0 else 0.0
+
+        verdict = ''
+        if abs(delta) > max(args.floor, spread) and (base_median == 0 or abs(percent) > args.threshold):
+            verdict = 'REGRESSION' if delta > 0 else 'improved'
+            if delta > 0:
+                regressions += 1
+
+        print(f'{pass_name:<5} {name:<20} {base_median:8.2f} {new_median:8.2f} {percent:+7.1f}%  {verdict}')
+
+    if regressions:
+        print(f'\n{regressions} regression(s)', file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
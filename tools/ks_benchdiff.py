@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Compare the decisions of two builds of a plugin, eg before and after a rewrite of its handlers.
+
+Usage: ks_benchdiff.py before/KillSwitchBench.decisions KillSwitchBench.decisions [-o repro.stream]
+
+Takes the .decisions files the handler bench writes next to itself. Both builds replay the same seeded random stream
+(and the same recorded stream, if one was given to both), so every event should leave the same result and state.
+Reports the first event where they differ, and writes a reproducer in the bench's .stream format: the events from the
+last time the bench reset the plugin state up to the difference (at most 128 for the random stream).
+Copy it next to both bench EBOOTs as <module>.stream, the recorded stream starts from a reset too, so it replays the same way.
+
+The reproducer is that whole prefix, it isn't minimised. Finding which of its events matter means replaying subsets
+on both builds, and the bench only runs on the PSP or PPSSPP, so cut it down by hand from there.
+
+Exits 1 if the builds differ, 2 if the logs aren't from the same streams.
+"""
+
+import argparse
+import sys
+
+RESET = ('reset', 0, 0, 0, {})
+
+
+def load(path):
+    """Returns {stream: [(kind, value, delay_us, result, state)]}, with RESET where the bench reset the plugin state"""
+    streams = {}
+    with open(path, encoding='utf-8') as f:
+        for line in f:
+            event, _, outcome = line.partition(' -> ')
+            fields = event.split()
+            if len(fields) == 3 and fields[2] == 'reset':
+                streams.setdefault(fields[0], []).append(RESET)
+                continue
+            if len(fields) != 5 or not outcome:
+                continue
+            stream, _, kind, value, delay = fields
+            result, *state = outcome.split()
+            streams.setdefault(stream, []).append((kind, int(value, 16), int(delay, 16), int(result, 16),
+                                                   dict(zip(state[0::2], (int(v) for v in state[1::2])))))
+    return streams
+
+
+def reproducer(entries, divergence):
+    """Events from the last reset up to and including the divergent one, not minimised"""
+    start = divergence
+    while start > 0 and entries[start - 1] != RESET:
+        start -= 1
+    return [(kind, value, delay) for kind, value, delay, _, _ in entries[start:divergence + 1]]
+
+
+def describe(entry):
+    kind, value, delay, result, state = entry
+    return f'{kind} {value:08x} +{delay}us -> {result:08x} ' + ' '.join(f'{k} {v}' for k, v in state.items())
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('legacy', help='.decisions of the known good build')
+    parser.add_argument('new', help='.decisions of the build to check')
+    parser.add_argument('-o', '--output', help='write the reproducer stream here')
+    args = parser.parse_args()
+
+    legacy = load(args.legacy)
+    new = load(args.new)
+
+    if set(legacy) != set(new):
+        print(f'the logs have different streams: {sorted(legacy)} and {sorted(new)}', file=sys.stderr)
+        sys.exit(2)
+
+    for stream in sorted(legacy):
+        a = legacy[stream]
+        b = new[stream]
+        if len(a) != len(b):
+            print(f'{stream}: {len(a)} and {len(b)} events, the streams aren\'t the same', file=sys.stderr)
+            sys.exit(2)
+
+        for i, (x, y) in enumerate(zip(a, b)):
+            if x == y:
+                continue
+            if x[:3] != y[:3]:
+                print(f'{stream} event {i}: {x[0]} {x[1]:08x} +{x[2]}us and {y[0]} {y[1]:08x} +{y[2]}us, '
+                      'the streams aren\'t the same', file=sys.stderr)
+                sys.exit(2)
+
+            index = i - a[:i].count(RESET)
+            print(f'{stream} stream, event {index} differs:')
+            print(f'  legacy: {describe(x)}')
+            print(f'  new:    {describe(y)}')
+
+            events = reproducer(a, i)
+            print(f'reproducer: {len(events)} events')
+            for kind, value, delay in events:
+                print(f'  {kind} {value:08x} +{delay}us')
+            if args.output:
+                with open(args.output, 'w', encoding='utf-8') as f:
+                    for kind, value, delay in events:
+                        f.write(f'{kind} {value:08x} {delay:x}\n')
+            sys.exit(1)
+
+        print(f'{stream} stream: {len(a) - a.count(RESET)} events, identical')
+
+
+if __name__ == '__main__':
+    main()
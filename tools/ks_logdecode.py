@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Decode a tokenized KillSwitch debug log (.klog) back into text.
+
+Usage: ks_logdecode.py --dict KillSwitch.logdict.json KillSwitch.klog
+
+Each record is [id:16 | nargs:8 | kind:8] [timestamp_us] [args...], little endian (see ks_log.h).
+%s arguments are kernel pointers and can't be recovered, they are printed as <str@address>.
+Trace records (KILLSWITCH_TRACE builds) are skipped unless --trace is given, use ks_trace2chrome.py to view them.
+"""
+
+import argparse
+import concurrent.futures
+import json
+import os
+import re
+import struct
+import sys
+
+KS_LOG_ID_SESSION = 0x0000
+KS_LOG_ID_DROPPED = 0xFFFF
+
+KS_LOG_KIND_PRINT = 0
+KS_LOG_KIND_TRACE = 1
+
+SPEC_RE = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(?:hh|h|ll|l)?([diuxXcsp%])')
+
+
+def to_signed(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def render(fmt, args):
+    args = list(args)
+
+    def substitute(m):
+        flags, width, precision, conv = m.groups()
+        if conv == '%':
+            return '%'
+        value = args.pop(0) if args else 0
+        if conv == 's':
+            return f'<str@0x{value:08x}>'
+        if conv == 'p':
+            return f'0x{value:08x}'
+        if conv in 'di':
+            value = to_signed(value)
+            conv = 'd'
+        if conv == 'c':
+            value = chr(value & 0xFF)
+            return value
+        spec = '%' + flags + width + (('.' + precision) if precision else '') + conv
+        return spec % value
+
+    return SPEC_RE.sub(substitute, fmt)
+
+
+def records(stream):
+    while True:
+        header = stream.read(8)
+        if len(header) < 8:
+            return
+        word, timestamp = struct.unpack('<II', header)
+        record_id = word & 0xFFFF
+        nargs = (word >> 16) & 0xFF
+        kind = (word >> 24) & 0xFF
+        data = stream.read(4 * nargs)
+        if len(data) < 4 * nargs:
+            return
+        yield record_id, kind, timestamp, struct.unpack(f'<{nargs}I', data)
+
+
+def output_paths(logs, output_dir, suffix):
+    """Output file for each log when a set of them is converted into output_dir. Logs from different units all have the
+    same name, so where names clash the directories they came from are kept, eg unit3/KillSwitch.klog -> unit3_KillSwitch.json"""
+    stems = [os.path.splitext(os.path.basename(log))[0] for log in logs]
+    if len(set(stems)) < len(stems):
+        common = os.path.commonpath([os.path.abspath(log) for log in logs])
+        stems = [os.path.splitext(os.path.relpath(os.path.abspath(log), common))[0].replace(os.sep, '_') for log in logs]
+    return [os.path.join(output_dir, stem + suffix) for stem in stems]
+
+
+def convert_logs(convert, jobs, *arg_lists):
+    """Calls convert(*args) for each set of arguments, spread over jobs worker processes (0 for one per core).
+    Each worker converts whole logs with its own converter state, nothing is shared between them.
+    convert has to be a module level function so it can be handed to the workers. Returns the results in order."""
+    if jobs == 0:
+        jobs = os.cpu_count() or 1
+    if jobs == 1 or len(arg_lists[0]) <= 1:
+        return list(map(convert, *arg_lists))
+    with concurrent.futures.ProcessPoolExecutor(max_workers=min(jobs, len(arg_lists[0]))) as pool:
+        return list(pool.map(convert, *arg_lists))
+
+
+def decode(stream, formats, out, trace=False):
+    for record_id, kind, timestamp, args in records(stream):
+        if kind == KS_LOG_KIND_TRACE:
+            if not trace:
+                continue
+            text = f'trace event {record_id} ' + ' '.join(f'0x{a:08x}' for a in args)
+        elif record_id == KS_LOG_ID_SESSION:
+            text = '--- session start ---\n'
+        elif record_id == KS_LOG_ID_DROPPED:
+            text = f'--- {args[0] if args else "?"} records dropped ---\n'
+        else:
+            fmt = formats.get(str(record_id))
+            if fmt is None:
+                text = f'<unknown id {record_id}> {" ".join(f"0x{a:08x}" for a in args)}\n'
+            else:
+                text = render(fmt, args)
+        if not text.endswith('\n'):
+            text += '\n'
+        out.write(f'[{timestamp / 1000.0:12.3f} ms] {text}')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--dict', required=True, help='dictionary from ks_logdict.py')
+    parser.add_argument('--trace', action='store_true', help='also print raw trace records')
+    parser.add_argument('log', help='.klog file from the PSP')
+    args = parser.parse_args()
+
+    with open(args.dict, encoding='utf-8') as f:
+        formats = json.load(f)['formats']
+
+    with open(args.log, 'rb') as stream:
+        decode(stream, formats, sys.stdout, args.trace)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Extract the DEBUG_PRINT format strings of a plugin into a log dictionary.
+
+Debug builds log each DEBUG_PRINT call site as its source line number (see ks_log.h), so the
+dictionary maps line numbers back to format strings. Adjacent string literals are joined and
+simple #defines (string or number, including through str()/xstr()) are resolved, which covers
+strings such as MODULE_NAME " v" xstr(MAJOR_VER).
+
+Usage: ks_logdict.py killswitch.c [--defines header.h ...] -o KillSwitch.logdict.json
+"""
+
+import argparse
+import json
+import re
+import sys
+
+DEFINE_RE = re.compile(r'^\s*#\s*define\s+(\w+)\s+(.+?)\s*(//.*)?$')
+TOKEN_RE = re.compile(r'\s*("(?:\\.|[^"\\])*"|\w+\s*\(\s*\w+\s*\)|\w+)')
+
+
+def read_defines(paths):
+    defines = {}
+    for path in paths:
+        with open(path, encoding='utf-8') as f:
+            for line in f:
+                m = DEFINE_RE.match(line)
+                if m and '(' not in m.group(1):
+                    defines[m.group(1)] = m.group(2)
+    return defines
+
+
+def unescape(literal):
+    return bytes(literal[1:-1], 'utf-8').decode('unicode_escape')
+
+
+def expand(name, defines, depth=0):
+    """Expand a define to its final text, following chains of defines."""
+    value = defines.get(name)
+    if value is None or depth > 8:
+        return None
+    if value in defines:
+        return expand(value, defines, depth + 1)
+    return value
+
+
+def resolve_format(expr, defines, where):
+    """Turn the first DEBUG_PRINT argument into the format string it compiles to."""
+    out = []
+    pos = 0
+    while pos < len(expr):
+        m = TOKEN_RE.match(expr, pos)
+        if not m:
+            if expr[pos:].strip():
+                raise ValueError(f'{where}: cannot parse format expression {expr!r}')
+            break
+        token = m.group(1)
+        pos = m.end()
+        if token.startswith('"'):
+            out.append(unescape(token))
+            continue
+        call = re.match(r'(\w+)\s*\(\s*(\w+)\s*\)', token)
+        if call and call.group(1) in ('str', 'xstr'):
+            arg = call.group(2)
+            value = expand(arg, defines) if call.group(1) == 'xstr' else None
+            out.append(value if value is not None else arg)
+            continue
+        value = expand(token, defines)
+        if value is None or not value.startswith('"'):
+            raise ValueError(f'{where}: cannot resolve {token!r} in format expression')
+        out.append(''.join(unescape(s) for s in re.findall(r'"(?:\\.|[^"\\])*"', value)))
+    return ''.join(out)
+
+
+def first_argument(text, start):
+    """Return the text of the first macro argument beginning at start (just after the open paren)."""
+    depth = 0
+    in_string = False
+    i = start
+    while i < len(text):
+        c = text[i]
+        if in_string:
+            if c == '\\':
+                i += 1
+            elif c == '"':
+                in_string = False
+        elif c == '"':
+            in_string = True
+        elif c == '(':
+            depth += 1
+        elif c == ')':
+            if depth == 0:
+                return text[start:i]
+            depth -= 1
+        elif c == ',' and depth == 0:
+            return text[start:i]
+        i += 1
+    raise ValueError('unterminated DEBUG_PRINT')
+
+
+def extract(source, defines):
+    with open(source, encoding='utf-8') as f:
+        text = f.read()
+
+    formats = {}
+    for m in re.finditer(r'\bDEBUG_PRINT\s*\(', text):
+        line_start = text.rfind('\n', 0, m.start()) + 1
+        prefix = text[line_start:m.start()]
+        if '//' in prefix or prefix.lstrip().startswith('#'):
+            continue
+        line = text.count('\n', 0, m.start()) + 1
+        where = f'{source}:{line}'
+        formats[str(line)] = resolve_format(first_argument(text, m.end()).strip(), defines, where)
+    return formats
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('source', help='plugin source file')
+    parser.add_argument('--defines', nargs='*', default=[], help='extra headers to read #defines from')
+    parser.add_argument('--module', help='module name recorded in the dictionary')
+    parser.add_argument('-o', '--output', required=True, help='dictionary to write')
+    args = parser.parse_args()
+
+    defines = read_defines(args.defines + [args.source])
+    try:
+        formats = extract(args.source, defines)
+    except ValueError as e:
+        sys.exit(f'ks_logdict: {e}')
+
+    module = args.module or expand('MODULE_NAME', defines) or ''
+    with open(args.output, 'w', encoding='utf-8') as f:
+        json.dump({'module': module.strip('"'), 'source': args.source, 'formats': formats}, f, indent=1, sort_keys=True)
+        f.write('\n')
+
+
+if __name__ == '__main__':
+    main()
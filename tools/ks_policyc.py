@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+"""Compile power switch rules into a KillSwitch policy program (.kpol), see ks_policy.h.
+
+Usage: ks_policyc.py rules.txt -o KillSwitch.kpol [-l]
+
+Needs a plugin built with -DKILLSWITCH_POLICY=ON. Copy the program to ms0:/SEPLUGINS/ named after the module,
+it's loaded at boot. One rule per line, tried in order, the first whose condition holds decides the press:
+  # Always let the override combo through, and refuse presses right after hold is switched off
+  allow if buttons has HOME|SELECT
+  block if hold_release_ms < 1000
+  allow if ac
+  default
+A rule is allow, block or default (leave it to the plugin's own rules), with an optional `if <condition>`.
+Without a final unconditional rule the program ends in default. The program doesn't run when the pad can't be
+read, the plugin's own rules decide the press (KillSwitch allows it, KillSwitchHold still applies its lockout),
+so pad_error is always 0 and is only kept so older programs still load.
+
+Conditions use the inputs
+  buttons, pad_error, idle_ms, hold_release_ms, hold, battery, ac, low_battery
+numbers (decimal or 0x hex), button names (SELECT, START, UP, ..., HOME, HOLD) combined with |,
+comparisons == != < <= > >= and `has` (all the given bits are set), not, and, or, and parentheses.
+
+-l prints the instructions. Exits 1 if the rules don't compile.
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+# Keep in step with ks_policy.h
+VERSION = 1
+MAX_INSNS = 64
+MAX_STACK = 8
+
+DEFAULT, ALLOW, BLOCK = 0, 1, 2
+VERDICTS = {'default': DEFAULT, 'allow': ALLOW, 'block': BLOCK}
+
+OPS = ['ret', 'const', 'input', 'jz', 'not', 'and', 'or', 'bor', 'has', 'eq', 'ne', 'lt', 'le', 'gt', 'ge']
+OP = {name: n for n, name in enumerate(OPS)}
+
+INPUTS = ['buttons', 'pad_error', 'idle_ms', 'hold_release_ms', 'hold', 'battery', 'ac', 'low_battery']
+
+COMPARISONS = {'==': 'eq', '!=': 'ne', '<': 'lt', '<=': 'le', '>': 'gt', '>=': 'ge', 'has': 'has'}
+
+# pspctrl.h
+BUTTONS = {
+    'SELECT': 0x000001, 'START': 0x000008, 'UP': 0x000010, 'RIGHT': 0x000020, 'DOWN': 0x000040, 'LEFT': 0x000080,
+    'LTRIGGER': 0x000100, 'RTRIGGER': 0x000200, 'TRIANGLE': 0x001000, 'CIRCLE': 0x002000, 'CROSS': 0x004000,
+    'SQUARE': 0x008000, 'HOME': 0x010000, 'HOLD': 0x020000, 'WLAN_UP': 0x040000, 'REMOTE': 0x080000,
+    'VOLUP': 0x100000, 'VOLDOWN': 0x200000, 'SCREEN': 0x400000, 'NOTE': 0x800000, 'DISC': 0x1000000,
+    'MS': 0x2000000,
+}
+
+TOKEN_RE = re.compile(r'\s*(?:(0x[0-9a-fA-F]+|\d+)|([A-Za-z_][A-Za-z0-9_]*)|(==|!=|<=|>=|<|>|\||\(|\)))')
+
+
+class PolicyError(Exception):
+    pass
+
+
+def insn(op, arg=0, imm=0):
+    return OP[op] | (arg << 8) | (imm << 16)
+
+
+def tokenize(text):
+    tokens = []
+    pos = 0
+    text = text.rstrip()
+    while pos < len(text):
+        match = TOKEN_RE.match(text, pos)
+        if not match:
+            raise PolicyError(f'unexpected "{text[pos:].strip()}"')
+        number, word, symbol = match.groups()
+        if number is not None:
+            tokens.append(('num', int(number, 0)))
+        elif word is not None:
+            tokens.append(('word', word))
+        else:
+            tokens.append(('sym', symbol))
+        pos = match.end()
+    return tokens
+
+
+class Parser:
+    """Recursive descent over one condition, emitting stack code as it goes"""
+
+    def __init__(self, tokens):
+        self.tokens = tokens
+        self.pos = 0
+        self.code = []
+
+    def peek(self):
+        return self.tokens[self.pos] if self.pos < len(self.tokens) else (None, None)
+
+    def take(self):
+        token = self.peek()
+        if token[0] is None:
+            raise PolicyError('condition ends early')
+        self.pos += 1
+        return token
+
+    def accept(self, value):
+        if self.peek()[1] == value:
+            self.pos += 1
+            return True
+        return False
+
+    def parse(self):
+        self.expr()
+        if self.pos != len(self.tokens):
+            raise PolicyError(f'unexpected "{self.peek()[1]}"')
+        return self.code
+
+    def expr(self):
+        self.conjunction()
+        while self.accept('or'):
+            self.conjunction()
+            self.code.append(insn('or'))
+
+    def conjunction(self):
+        self.negation()
+        while self.accept('and'):
+            self.negation()
+            self.code.append(insn('and'))
+
+    def negation(self):
+        if self.accept('not'):
+            self.negation()
+            self.code.append(insn('not'))
+        else:
+            self.comparison()
+
+    def comparison(self):
+        self.value()
+        op = COMPARISONS.get(self.peek()[1])
+        if op:
+            self.pos += 1
+            self.value()
+            self.code.append(insn(op))
+
+    def value(self):
+        # Constants either side of | are folded, so HOME|SELECT is a single instruction
+        constant = self.term()
+        while self.accept('|'):
+            rhs = self.term()
+            if constant is not None and rhs is not None:
+                constant |= rhs
+                continue
+            if constant is not None:
+                self.code += push_constant(constant)
+            if rhs is not None:
+                self.code += push_constant(rhs)
+            self.code.append(insn('bor'))
+            constant = None
+        if constant is not None:
+            self.code += push_constant(constant)
+
+    def term(self):
+        """Returns the value of a constant term without emitting it, None if code was emitted"""
+        kind, value = self.take()
+        if kind == 'num':
+            if value > 0xFFFFFFFF:
+                raise PolicyError(f'{value} doesn\'t fit in 32 bits')
+            return value
+        if kind == 'word' and value in BUTTONS:
+            return BUTTONS[value]
+        if kind == 'word' and value in INPUTS:
+            self.code.append(insn('input', INPUTS.index(value)))
+            return None
+        if value == '(':
+            self.expr()
+            if not self.accept(')'):
+                raise PolicyError('missing )')
+            return None
+        raise PolicyError(f'unknown name "{value}"' if kind == 'word' else f'unexpected "{value}"')
+
+
+def push_constant(value):
+    """CONST pushes imm << arg, bigger values are made of two halves"""
+    shift = 0
+    while shift < 16 and value >> shift > 0xFFFF:
+        shift += 1
+    if value == (value >> shift) << shift and value >> shift <= 0xFFFF:
+        return [insn('const', shift, value >> shift)]
+    return [insn('const', 16, value >> 16), insn('const', 0, value & 0xFFFF), insn('bor')]
+
+
+def max_depth(code):
+    depth = deepest = 0
+    for word in code:
+        op = OPS[word & 0xFF]
+        depth += 1 if op in ('const', 'input') else 0 if op in ('not', 'ret') else -1
+        deepest = max(deepest, depth)
+    return deepest
+
+
+def compile_rules(lines):
+    """Returns the program as a list of instruction words"""
+    program = []
+    finished = False
+    for number, line in enumerate(lines, 1):
+        text = line.split('#', 1)[0].strip()
+        if not text:
+            continue
+        try:
+            if finished:
+                raise PolicyError('rule after an unconditional rule never runs')
+            verdict, _, condition = text.partition(' ')
+            if verdict not in VERDICTS:
+                raise PolicyError(f'a rule starts with allow, block or default, not "{verdict}"')
+            condition = condition.strip()
+            if not condition:
+                program.append(insn('ret', VERDICTS[verdict]))
+                finished = True
+                continue
+            if not condition.startswith('if ') and condition != 'if':
+                raise PolicyError(f'expected "if" after {verdict}')
+            code = Parser(tokenize(condition[2:])).parse()
+            if max_depth(code) > MAX_STACK:
+                raise PolicyError(f'condition needs more than {MAX_STACK} stack slots, split it into several rules')
+            program += code + [insn('jz', 0, 1), insn('ret', VERDICTS[verdict])]
+        except PolicyError as e:
+            raise PolicyError(f'line {number}: {e}') from None
+
+    if not finished:
+        program.append(insn('ret', DEFAULT))
+    if len(program) > MAX_INSNS:
+        raise PolicyError(f'{len(program)} instructions, the plugin takes at most {MAX_INSNS}')
+    return program
+
+
+def disassemble(word):
+    op, arg, imm = OPS[word & 0xFF], (word >> 8) & 0xFF, word >> 16
+    if op == 'ret':
+        return f'ret {next(name for name, v in VERDICTS.items() if v == arg)}'
+    if op == 'const':
+        return f'const 0x{imm << arg:x}'
+    if op == 'input':
+        return f'input {INPUTS[arg]}'
+    if op == 'jz':
+        return f'jz +{imm}'
+    return op
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('rules', help='rules file')
+    parser.add_argument('-o', '--output', help='program to write, defaults to the rules file with a .kpol extension')
+    parser.add_argument('-l', '--list', action='store_true', help='print the instructions')
+    args = parser.parse_args()
+
+    with open(args.rules, encoding='utf-8') as f:
+        try:
+            program = compile_rules(f)
+        except PolicyError as e:
+            print(f'{args.rules}: {e}', file=sys.stderr)
+            sys.exit(1)
+
+    if args.list:
+        for n, word in enumerate(program):
+            print(f'{n:3} {word:08x}  {disassemble(word)}')
+
+    output = args.output or os.path.splitext(args.rules)[0] + '.kpol'
+    with open(output, 'wb') as f:
+        f.write(b'KPOL' + struct.pack('<BBH', VERSION, len(program), 0))
+        f.write(struct.pack(f'<{len(program)}I', *program))
+    print(f'{output}: {len(program)} instructions')
+
+
+if __name__ == '__main__':
+    main()
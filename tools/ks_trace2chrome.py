@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+"""Convert a KillSwitch trace (.klog recorded with -DKILLSWITCH_TRACE=ON) into Chrome trace-event JSON.
+
+Usage: ks_trace2chrome.py KillSwitch.klog -o trace.json [--dict KillSwitch.logdict.json]
+       ks_trace2chrome.py traces/*/*.klog -o out/ [-j 8]
+
+Open the output in chrome://tracing or https://ui.perfetto.dev. Each plugin session (module start) is a process,
+with the callback thread and ScePowerMain on their own tracks. Power callbacks and sysevent handler calls are
+slices, pad samples, switch/hold edges and decisions are instants, and allow_sleep is a counter track.
+Debug prints are included as instants when a dictionary is given.
+
+Records are converted one at a time and written straight out, so multi-hour traces don't need to fit in memory.
+Given several traces, -o is a directory and each trace is converted to its own .json there, on all cores by default.
+"""
+
+import argparse
+import json
+import os
+import sys
+
+from ks_logdecode import KS_LOG_ID_DROPPED, KS_LOG_ID_SESSION, convert_logs, output_paths, records, render
+
+KS_LOG_KIND_PRINT = 0
+KS_LOG_KIND_TRACE = 1
+
+KS_TRACE_CALLBACK_BEGIN = 1
+KS_TRACE_CALLBACK_END = 2
+KS_TRACE_PAD_SAMPLE = 3
+KS_TRACE_SYSEVENT_BEGIN = 4
+KS_TRACE_SYSEVENT_END = 5
+KS_TRACE_DECISION = 6
+
+PSP_POWER_CB_POWER_SWITCH = 0x80000000
+PSP_POWER_CB_HOLD_SWITCH = 0x40000000
+
+SYSEVENT_NAMES = {
+    0x100: 'suspend query',
+    0x101: 'suspend cancellation',
+    0x102: 'suspend start',
+    0x400000: 'resume completed',
+}
+
+SYSEVENT_RESULTS = {
+    0x00000000: 'OK',
+    0x80000021: 'BUSY',
+}
+
+REASONS = {
+    1: 'combo held',
+    2: 'no combo',
+    3: 'pad error',
+    4: 'external request',
+    5: 'hold lockout',
+    6: 'outside hold lockout',
+    7: 'failsafe',
+    8: 'low battery',
+    9: 'idle',
+    10: 'policy',
+}
+
+
+class Converter:
+    def __init__(self, out, formats):
+        self.out = out
+        self.formats = formats
+        self.first = True
+        self.pid = 0
+        self.named_threads = set()
+        self.last_raw = None
+        self.wrap = 0
+        self.pwrflags = None
+
+    def emit(self, event):
+        self.out.write('[\n' if self.first else ',\n')
+        self.first = False
+        json.dump(event, self.out, separators=(',', ':'))
+
+    def finish(self):
+        self.out.write('[\n]\n' if self.first else '\n]\n')
+
+    def timestamp(self, raw):
+        # sceKernelGetSystemTimeLow() wraps every ~71 minutes
+        if self.last_raw is not None and raw < self.last_raw and self.last_raw - raw > 0x80000000:
+            self.wrap += 1 << 32
+        self.last_raw = raw
+        return raw + self.wrap
+
+    def new_session(self, ts):
+        self.pid += 1
+        self.named_threads.clear()
+        self.pwrflags = None
+        self.emit({'ph': 'M', 'name': 'process_name', 'pid': self.pid, 'tid': 0,
+                   'args': {'name': f'session {self.pid}'}})
+        self.emit({'ph': 'i', 'name': 'module start', 'pid': self.pid, 'tid': 0, 'ts': ts, 's': 'p'})
+
+    def name_thread(self, tid, name):
+        if tid not in self.named_threads:
+            self.named_threads.add(tid)
+            self.emit({'ph': 'M', 'name': 'thread_name', 'pid': self.pid, 'tid': tid, 'args': {'name': name}})
+
+    def instant(self, name, ts, tid, args=None, scope='t'):
+        event = {'ph': 'i', 'name': name, 'pid': self.pid, 'tid': tid, 'ts': ts, 's': scope}
+        if args:
+            event['args'] = args
+        self.emit(event)
+
+    def edges(self, pwrflags, ts, tid):
+        previous = self.pwrflags
+        self.pwrflags = pwrflags
+        for bit, on, off in ((PSP_POWER_CB_POWER_SWITCH, 'power switch pressed', 'power switch released'),
+                             (PSP_POWER_CB_HOLD_SWITCH, 'hold on', 'hold off')):
+            level = bool(pwrflags & bit)
+            if previous is None or level != bool(previous & bit):
+                if previous is not None or level:
+                    self.instant(on if level else off, ts, tid, scope='p')
+
+    def trace(self, event, ts, args):
+        tid, value = (args + (0, 0))[:2]
+        if event in (KS_TRACE_CALLBACK_BEGIN, KS_TRACE_CALLBACK_END, KS_TRACE_PAD_SAMPLE):
+            self.name_thread(tid, 'callback thread')
+        elif event in (KS_TRACE_SYSEVENT_BEGIN, KS_TRACE_SYSEVENT_END):
+            self.name_thread(tid, 'ScePowerMain')
+
+        if event == KS_TRACE_CALLBACK_BEGIN:
+            self.emit({'ph': 'B', 'name': 'power callback', 'pid': self.pid, 'tid': tid, 'ts': ts,
+                       'args': {'pwrflags': f'0x{value:08x}'}})
+            self.edges(value, ts, tid)
+        elif event == KS_TRACE_CALLBACK_END:
+            self.emit({'ph': 'E', 'pid': self.pid, 'tid': tid, 'ts': ts})
+        elif event == KS_TRACE_PAD_SAMPLE:
+            if value & 0x80000000:
+                self.instant('pad read failed', ts, tid, {'error': f'0x{value:08x}'})
+            else:
+                self.instant('pad sample', ts, tid, {'buttons': f'0x{value:08x}'})
+        elif event == KS_TRACE_SYSEVENT_BEGIN:
+            self.emit({'ph': 'B', 'name': SYSEVENT_NAMES.get(value, f'sysevent 0x{value:08x}'),
+                       'pid': self.pid, 'tid': tid, 'ts': ts})
+        elif event == KS_TRACE_SYSEVENT_END:
+            self.emit({'ph': 'E', 'pid': self.pid, 'tid': tid, 'ts': ts,
+                       'args': {'result': SYSEVENT_RESULTS.get(value, f'0x{value:08x}')}})
+        elif event == KS_TRACE_DECISION:
+            allow = value & 1
+            reason = REASONS.get(value >> 8, str(value >> 8))
+            self.instant('allow sleep' if allow else 'block sleep', ts, tid, {'reason': reason})
+            self.emit({'ph': 'C', 'name': 'allow_sleep', 'pid': self.pid, 'tid': 0, 'ts': ts,
+                       'args': {'allow_sleep': allow}})
+        else:
+            self.instant(f'trace event {event}', ts, tid, {'value': f'0x{value:08x}'})
+
+    def convert(self, stream):
+        for record_id, kind, raw, args in records(stream):
+            ts = self.timestamp(raw)
+            if kind == KS_LOG_KIND_PRINT and record_id == KS_LOG_ID_SESSION:
+                self.new_session(ts)
+                continue
+            if self.pid == 0:
+                # Trace started mid-session, eg the log was rotated
+                self.new_session(ts)
+            if kind == KS_LOG_KIND_TRACE:
+                self.trace(record_id, ts, args)
+            elif record_id == KS_LOG_ID_DROPPED:
+                self.instant(f'{args[0] if args else "?"} records dropped', ts, 0, scope='g')
+            elif self.formats is not None:
+                fmt = self.formats.get(str(record_id))
+                text = render(fmt, args) if fmt is not None else f'<unknown id {record_id}>'
+                self.instant(text.strip(), ts, 0)
+
+
+def convert_file(log, output, formats):
+    out = open(output, 'w', encoding='utf-8') if output else sys.stdout
+    try:
+        converter = Converter(out, formats)
+        with open(log, 'rb') as stream:
+            converter.convert(stream)
+        converter.finish()
+    finally:
+        if output:
+            out.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('log', nargs='+', help='.klog file(s) from the PSP')
+    parser.add_argument('-o', '--output', help='trace JSON to write, defaults to stdout. A directory for several logs')
+    parser.add_argument('--dict', help='dictionary from ks_logdict.py, to include debug prints')
+    parser.add_argument('-j', '--jobs', type=int, default=0, help='logs converted at once, default one per core')
+    args = parser.parse_args()
+
+    formats = None
+    if args.dict:
+        with open(args.dict, encoding='utf-8') as f:
+            formats = json.load(f)['formats']
+
+    if len(args.log) == 1:
+        convert_file(args.log[0], args.output, formats)
+        return
+
+    if not args.output:
+        parser.error('-o DIR is needed for several logs')
+    os.makedirs(args.output, exist_ok=True)
+    outputs = output_paths(args.log, args.output, '.json')
+    convert_logs(convert_file, args.jobs, args.log, outputs, [formats] * len(args.log))
+
+
+if __name__ == '__main__':
+    main()
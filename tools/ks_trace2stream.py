@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Turn a KillSwitch trace (.klog recorded with -DKILLSWITCH_TRACE=ON) into an event stream for the handler bench.
+
+Usage: ks_trace2stream.py KillSwitch.klog -o KillSwitch.stream
+       ks_trace2stream.py traces/*/*.klog -o streams/ [-j 8]
+
+The stream is one event per line, in the order the plugin saw them:
+  pad <buttons> <delay>   pad state for the following reads, or the read error (80000000 and up)
+  cb <pwrflags> <delay>   power callback
+  ev <event id> <delay>   sysevent
+all in hex. The delay is the time in us since the previous event, which the bench advances its virtual clock by.
+A pad sample is recorded inside the handler that read it, so it's written out before that handler, with no delay.
+Copy the stream next to the bench EBOOT, named after the module the trace came from.
+Given several traces, -o is a directory and each trace is converted to its own .stream there, on all cores by default.
+"""
+
+import argparse
+import os
+import sys
+
+from ks_logdecode import convert_logs, output_paths, records
+
+KS_LOG_KIND_TRACE = 1
+
+KS_TRACE_CALLBACK_BEGIN = 1
+KS_TRACE_CALLBACK_END = 2
+KS_TRACE_PAD_SAMPLE = 3
+KS_TRACE_SYSEVENT_BEGIN = 4
+KS_TRACE_SYSEVENT_END = 5
+
+# Keep in step with BENCH_STREAM_MAX in bench/handler_bench.c
+STREAM_MAX = 4096
+
+
+def events(stream):
+    """Yields (kind, value, timestamp) in replay order"""
+    pending = None
+    for record_id, kind, timestamp, args in records(stream):
+        if kind != KS_LOG_KIND_TRACE or len(args) < 2:
+            continue
+        value = args[1]
+        if record_id in (KS_TRACE_CALLBACK_BEGIN, KS_TRACE_SYSEVENT_BEGIN):
+            if pending is not None:
+                # The end record was lost, eg the ring overflowed
+                yield pending
+            pending = ('cb' if record_id == KS_TRACE_CALLBACK_BEGIN else 'ev', value, timestamp)
+        elif record_id == KS_TRACE_PAD_SAMPLE:
+            yield 'pad', value, timestamp
+        elif record_id in (KS_TRACE_CALLBACK_END, KS_TRACE_SYSEVENT_END) and pending is not None:
+            yield pending
+            pending = None
+    if pending is not None:
+        yield pending
+
+
+def convert_file(log, output):
+    """Returns the number of events written"""
+    out = open(output, 'w', encoding='utf-8') if output else sys.stdout
+    count = 0
+    previous = None
+    try:
+        with open(log, 'rb') as stream:
+            for kind, value, timestamp in events(stream):
+                # The timestamps are sceKernelGetSystemTimeLow() and wrap. A pad sample is taken after its handler
+                # started, so the handler's own timestamp is a little earlier and it gets no delay.
+                delay = 0 if previous is None else (timestamp - previous) & 0xFFFFFFFF
+                if delay >= 0x80000000:
+                    delay = 0
+                else:
+                    previous = timestamp
+                out.write(f'{kind} {value:08x} {delay:x}\n')
+                count += 1
+    finally:
+        if output:
+            out.close()
+    return count
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('log', nargs='+', help='.klog file(s) from the PSP')
+    parser.add_argument('-o', '--output', help='stream to write, defaults to stdout. A directory for several logs')
+    parser.add_argument('-j', '--jobs', type=int, default=0, help='logs converted at once, default one per core')
+    args = parser.parse_args()
+
+    if len(args.log) == 1:
+        counts = [convert_file(args.log[0], args.output)]
+    else:
+        if not args.output:
+            parser.error('-o DIR is needed for several logs')
+        os.makedirs(args.output, exist_ok=True)
+        counts = convert_logs(convert_file, args.jobs, args.log, output_paths(args.log, args.output, '.stream'))
+
+    for log, count in zip(args.log, counts):
+        if count > STREAM_MAX:
+            print(f'{log}: {count} events, the bench only replays the first {STREAM_MAX}', file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
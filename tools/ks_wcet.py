@@ -0,0 +1,348 @@
+#!/usr/bin/env python3
+"""Static worst case execution time bound for the KillSwitch handlers.
+
+Usage: ks_wcet.py --objdump psp-objdump KillSwitch.elf [--root killswitchSysEventHandler] [--budget name=cycles]
+
+Disassembles the module, builds the control flow graph of every function reachable from the roots
+(killswitchSysEventHandler and power_callback_handler by default) and finds the longest path through it.
+Calls are followed into the callee, imported functions (.sceStub.text) cost what tools/ks_wcet_bounds.json says.
+Loops need an iteration bound from the bounds file, an unbounded loop or an indirect jump is an error.
+
+Cycle counts assume every access hits the cache, with Allegrex latencies for multiply, divide and taken branches.
+They're for spotting growth, not for adding up against wall time. The cold cache cost is what the handler bench measures.
+
+Exits 1 if a root is over its --budget (0 disables the check), 2 if the bound can't be computed.
+"""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+FUNC_RE = re.compile(r'^([0-9a-f]+) <([^>]+)>:$')
+INSN_RE = re.compile(r'^\s*([0-9a-f]+):\s+[0-9a-f]{8}\s+(\S+)\s*(.*)$')
+SECTION_RE = re.compile(r'^Disassembly of section (\S+):$')
+TARGET_RE = re.compile(r'([0-9a-f]+) <([^>]+)>\s*$')
+
+STUB_SECTION = '.sceStub.text'
+
+# Conditional branches, the delay slot always counts (the likely forms only run it when taken, which is less)
+BRANCHES = {
+    'beq', 'bne', 'beqz', 'bnez', 'blez', 'bgtz', 'bltz', 'bgez',
+    'beql', 'bnel', 'beqzl', 'bnezl', 'blezl', 'bgtzl', 'bltzl', 'bgezl',
+    'bc1t', 'bc1f', 'bc1tl', 'bc1fl', 'bvf', 'bvt', 'bvfl', 'bvtl',
+}
+UNCONDITIONAL = {'b', 'j'}
+CALLS = {'jal', 'bal', 'bltzal', 'bgezal'}
+INDIRECT_CALLS = {'jalr'}
+
+# Allegrex cycle estimates, everything else is 1
+CYCLES = {
+    'mult': 5, 'multu': 5, 'madd': 5, 'maddu': 5, 'msub': 5, 'msubu': 5,
+    'div': 36, 'divu': 36,
+}
+TAKEN_BRANCH_CYCLES = 1 # Extra for a taken branch or jump
+
+DEFAULT_ROOTS = ['killswitchSysEventHandler', 'power_callback_handler']
+
+
+class WcetError(Exception):
+    pass
+
+
+def base_name(name):
+    # LTO and IPA clones get suffixes, eg decide_switch_press.constprop.0
+    return name.split('.')[0]
+
+
+def disassemble(objdump, elf):
+    output = subprocess.run([objdump, '-d', '-z', elf], check=True, capture_output=True, text=True).stdout
+    return parse(output.splitlines())
+
+
+def parse(lines):
+    """Returns {name: (section, [(addr, mnemonic, operands)])}"""
+    functions = {}
+    section = None
+    current = None
+    for line in lines:
+        m = SECTION_RE.match(line)
+        if m:
+            section = m.group(1)
+            current = None
+            continue
+        m = FUNC_RE.match(line)
+        if m:
+            current = []
+            functions[m.group(2)] = (section, current)
+            continue
+        m = INSN_RE.match(line)
+        if m and current is not None:
+            current.append((int(m.group(1), 16), m.group(2), m.group(3)))
+    return functions
+
+
+def branch_target(operands):
+    m = TARGET_RE.search(operands)
+    if not m:
+        return None, None
+    return int(m.group(1), 16), m.group(2)
+
+
+class Analyzer:
+    def __init__(self, functions, bounds):
+        self.functions = functions
+        self.by_base = {}
+        for name in functions:
+            self.by_base.setdefault(base_name(name), name)
+        self.loop_bounds = bounds.get('loops', {})
+        self.import_cycles = bounds.get('imports', {})
+        self.cache = {}
+        self.active = []
+
+    def resolve(self, name):
+        if name in self.functions:
+            return name
+        return self.by_base.get(base_name(name))
+
+    def import_cost(self, name):
+        name = base_name(name)
+        return self.import_cycles.get(name, self.import_cycles.get('default', 1000))
+
+    def call_cost(self, name, cycles):
+        section, _ = self.functions[name]
+        if section == STUB_SECTION:
+            return self.import_cost(name) if cycles else 0
+        return self.wcet(name, cycles)
+
+    def wcet(self, name, cycles=True):
+        """Longest path through name and its callees, in cycles or in instructions of this module"""
+        key = (name, cycles)
+        if key in self.cache:
+            return self.cache[key]
+        if name in self.active:
+            raise WcetError(f'recursion: {" -> ".join(self.active + [name])}')
+        self.active.append(name)
+        result = self.function_wcet(name, cycles)
+        self.active.pop()
+        self.cache[key] = result
+        return result
+
+    def function_wcet(self, name, cycles):
+        _, insns = self.functions[name]
+        if not insns:
+            return 0
+        start = insns[0][0]
+        end = insns[-1][0] + 4
+        index = {addr: i for i, (addr, _, _) in enumerate(insns)}
+
+        # Block leaders: the entry, branch targets, and whatever follows a branch's delay slot
+        leaders = {start}
+        for addr, mnemonic, operands in insns:
+            if mnemonic in BRANCHES or mnemonic in UNCONDITIONAL:
+                target, _ = branch_target(operands)
+                if target is not None and start <= target < end:
+                    leaders.add(target)
+                leaders.add(addr + 8)
+            elif mnemonic == 'jr':
+                leaders.add(addr + 8)
+            elif mnemonic == 'break':
+                # Trap, no delay slot
+                leaders.add(addr + 4)
+        leaders = sorted(a for a in leaders if a in index)
+
+        weights = {}
+        succs = {}
+        for n, leader in enumerate(leaders):
+            last = leaders[n + 1] if n + 1 < len(leaders) else end
+            weight = 0
+            edges = set()
+            falls_through = True
+            for addr, mnemonic, operands in insns[index[leader]:index[last] if last in index else len(insns)]:
+                weight += CYCLES.get(mnemonic, 1) if cycles else 1
+
+                if mnemonic in CALLS:
+                    _, callee = branch_target(operands)
+                    callee = self.resolve(callee) if callee else None
+                    if callee is None:
+                        raise WcetError(f'{name}+0x{addr - start:x}: call to unknown target "{operands}"')
+                    weight += self.call_cost(callee, cycles)
+                elif mnemonic in INDIRECT_CALLS:
+                    raise WcetError(f'{name}+0x{addr - start:x}: indirect call, not supported')
+                elif mnemonic in BRANCHES or mnemonic in UNCONDITIONAL:
+                    target, label = branch_target(operands)
+                    if target is None:
+                        raise WcetError(f'{name}+0x{addr - start:x}: can\'t read branch target "{operands}"')
+                    if cycles:
+                        weight += TAKEN_BRANCH_CYCLES
+                    if start <= target < end:
+                        edges.add(target)
+                    else:
+                        # Tail call, the callee returns for us
+                        callee = self.resolve(label)
+                        if callee is None:
+                            raise WcetError(f'{name}+0x{addr - start:x}: jump to unknown target "{operands}"')
+                        weight += self.call_cost(callee, cycles)
+                    if mnemonic in UNCONDITIONAL:
+                        falls_through = False
+                elif mnemonic == 'jr':
+                    if operands.strip() != 'ra':
+                        raise WcetError(f'{name}+0x{addr - start:x}: indirect jump (jump table?), not supported')
+                    falls_through = False
+                elif mnemonic == 'break':
+                    falls_through = False
+            if falls_through and last < end:
+                edges.add(last)
+            weights[leader] = weight
+            succs[leader] = edges
+
+        return self.longest_path(name, start, weights, succs)
+
+    def longest_path(self, name, entry, weights, succs):
+        # Collapse loops, innermost first, into single nodes costing (bound + 1) passes through their body
+        while True:
+            back_edges = find_back_edges(entry, succs)
+            if not back_edges:
+                break
+            loops = {}
+            for latch, header in back_edges:
+                loops.setdefault(header, set()).update(natural_loop(header, latch, succs))
+            header, body = min(loops.items(), key=lambda item: len(item[1]))
+
+            bound = self.loop_bounds.get(base_name(name))
+            if bound is None:
+                raise WcetError(f'{name}: loop at +0x{header - entry:x} has no bound, add "{base_name(name)}" to the loops in the bounds file')
+
+            inner = {n: {s for s in succs[n] if s in body and s != header} for n in body}
+            one_pass = max(dag_longest(header, weights, inner).values())
+            exits = set()
+            for n in body:
+                exits.update(s for s in succs[n] if s not in body)
+            for n in body:
+                if n != header:
+                    del weights[n]
+                    del succs[n]
+            for n in succs:
+                if succs[n] & body and n not in body:
+                    if (succs[n] & body) - {header}:
+                        raise WcetError(f'{name}: loop at +0x{header - entry:x} has more than one entry')
+            weights[header] = (bound + 1) * one_pass
+            succs[header] = exits
+
+        return max(dag_longest(entry, weights, succs).values())
+
+
+def find_back_edges(entry, succs):
+    back = []
+    state = {}
+    stack = [(entry, iter(sorted(succs[entry])))]
+    state[entry] = 1
+    while stack:
+        node, children = stack[-1]
+        child = next(children, None)
+        if child is None:
+            state[node] = 2
+            stack.pop()
+        elif state.get(child) == 1:
+            back.append((node, child))
+        elif child not in state:
+            state[child] = 1
+            stack.append((child, iter(sorted(succs[child]))))
+    return back
+
+
+def natural_loop(header, latch, succs):
+    preds = {}
+    for n, edges in succs.items():
+        for s in edges:
+            preds.setdefault(s, set()).add(n)
+    body = {header, latch}
+    work = [latch] if latch != header else []
+    while work:
+        n = work.pop()
+        for p in preds.get(n, ()):
+            if p not in body:
+                body.add(p)
+                work.append(p)
+    return body
+
+
+def dag_longest(entry, weights, succs):
+    """Longest path from entry to every reachable node, node weights included"""
+    order = []
+    seen = set()
+    stack = [(entry, False)]
+    while stack:
+        node, done = stack.pop()
+        if done:
+            order.append(node)
+            continue
+        if node in seen:
+            continue
+        seen.add(node)
+        stack.append((node, True))
+        for s in succs.get(node, ()):
+            if s not in seen:
+                stack.append((s, False))
+    dist = {entry: weights[entry]}
+    for node in reversed(order):
+        if node not in dist:
+            continue
+        for s in succs.get(node, ()):
+            if dist[node] + weights[s] > dist.get(s, -1):
+                dist[s] = dist[node] + weights[s]
+    return dist
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--objdump', default='psp-objdump', help='objdump for the PSP toolchain')
+    parser.add_argument('--bounds', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), 'ks_wcet_bounds.json'),
+                        help='loop bounds and import costs')
+    parser.add_argument('--root', action='append', help='function to bound, default: the two handlers')
+    parser.add_argument('--budget', action='append', default=[], help='name=cycles, fail if the bound is over it')
+    parser.add_argument('--module', help='name to print, default: the file name')
+    parser.add_argument('elf', help='module ELF (not the .prx)')
+    args = parser.parse_args()
+
+    with open(args.bounds, encoding='utf-8') as f:
+        bounds = json.load(f)
+    budgets = {}
+    for budget in args.budget:
+        root, _, cycles = budget.partition('=')
+        budgets[root] = int(cycles)
+
+    functions = disassemble(args.objdump, args.elf)
+    analyzer = Analyzer(functions, bounds)
+    module = args.module or os.path.basename(args.elf)
+
+    over = []
+    for root in args.root or DEFAULT_ROOTS:
+        name = analyzer.resolve(root)
+        if name is None:
+            print(f'{module}: {root} not found', file=sys.stderr)
+            sys.exit(2)
+        try:
+            cycles = analyzer.wcet(name, cycles=True)
+            insns = analyzer.wcet(name, cycles=False)
+        except WcetError as e:
+            print(f'{module}: {e}', file=sys.stderr)
+            sys.exit(2)
+
+        budget = budgets.get(root, 0)
+        status = ''
+        if budget > 0:
+            status = f'  budget {budget}' + ('  OVER' if cycles > budget else '')
+            if cycles > budget:
+                over.append(root)
+        print(f'{module:<16} {root:<28} {insns:6} insns {cycles:8} cycles{status}')
+
+    if over:
+        print(f'{module}: over the WCET budget: {", ".join(over)}', file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()